@@ -0,0 +1,350 @@
+// Headless benchmark driver, built as the treesheets-bench target.
+// usage: treesheets-bench [-n iterations] [-s search] [-w width] [-h height] [-o out.json]
+//                         file.cts...
+//        treesheets-bench -g chain|table|wide|text|images [-r seed] [-c count] -o out.cts
+
+struct BenchApp : TSApp {
+    long iterations {3};
+    long viewxs {1920};
+    long viewys {1080};
+    int searchsteps {100};
+    wxString searchstring {L"e"};
+    wxString outfilename;
+    wxArrayString filenames;
+    wxString shape;
+    unsigned long seed {1};
+    long count {0};
+    int exitcode {0};
+
+    struct Samples {
+        vector<double> ms;
+
+        void Add(chrono::steady_clock::time_point start) {
+            ms.push_back(
+                chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+
+        double Min() const { return ms.empty() ? 0 : *ranges::min_element(ms); }
+
+        wxString JSON() const {
+            double total = 0, hi = 0;
+            for (auto m : ms) {
+                total += m;
+                hi = max(hi, m);
+            }
+            return wxString::Format(L"{\"min\": %.3f, \"mean\": %.3f, \"max\": %.3f}", Min(),
+                                    ms.size() ? total / ms.size() : 0.0, hi);
+        }
+    };
+
+    bool OnInit() override {
+        exename = GetExecutablePath();
+        exepath = wxFileName(exename).GetPath();
+        headless = true;
+
+        for (int i = 1; i < argc; i++) {
+            wxString arg = argv[i];
+            if (arg.Len() == 2 && arg[0] == '-' && i + 1 < argc) {
+                wxString val = argv[++i];
+                switch (static_cast<int>(arg[1])) {
+                    case 'n': val.ToLong(&iterations); break;
+                    case 's': searchstring = val; break;
+                    case 'w': val.ToLong(&viewxs); break;
+                    case 'h': val.ToLong(&viewys); break;
+                    case 'o': outfilename = val; break;
+                    case 'g': shape = val; break;
+                    case 'r': val.ToULong(&seed); break;
+                    case 'c': val.ToLong(&count); break;
+                }
+            } else {
+                filenames.Add(arg);
+            }
+        }
+        if (shape.Len() ? !outfilename.Len() || count < 0
+                        : filenames.empty() || iterations < 1 || viewxs < 1 || viewys < 1) {
+            fputs("usage: treesheets-bench [-n iterations] [-s search] [-w width] [-h height] "
+                  "[-o out.json] file.cts...\n"
+                  "       treesheets-bench -g chain|table|wide|text|images [-r seed] [-c count] "
+                  "-o out.cts\n", stderr);
+            return false;
+        }
+
+        // Portable config so results do not depend on the user's settings.
+        sys = new System(true);
+        sys->fswatch = false;
+        sys->autohtmlexport = 0;
+        sys->makebaks = false;
+        frame = new TSFrame(this);
+        return true;
+    }
+
+    void OnEventLoopEnter(wxEventLoopBase *WXUNUSED(loop)) override {
+        if (initiateventloop || !frame) return;
+        initiateventloop = true;
+        sys->evaluator.Init();
+
+        if (shape.Len()) {
+            auto err = Generate();
+            if (*err) {
+                fputws(err, stderr);
+                fputws(L"\n", stderr);
+                exitcode = 1;
+            }
+            frame->Destroy();
+            return;
+        }
+
+        wxString json = wxString::Format(
+            L"{\n  \"version\": \"%s\",\n  \"iterations\": %ld,\n  \"search\": \"%s\",\n"
+            L"  \"viewport\": [%ld, %ld],\n  \"files\": [",
+            PACKAGE_VERSION, iterations, Escape(searchstring), viewxs, viewys);
+        loop(i, filenames.size()) {
+            if (i) json += L",";
+            json += L"\n    " + RunFile(filenames[i]);
+        }
+        json += wxString::Format(L"\n  ],\n  \"peak_rss_bytes\": %llu\n}\n",
+                                 (unsigned long long)PeakRSS());
+
+        if (outfilename.Len()) {
+            wxFFile out(outfilename, L"w");
+            if (!out.IsOpened() || !out.Write(json)) exitcode = 1;
+        } else {
+            fputs(json.utf8_str(), stdout);
+        }
+        frame->Destroy();
+    }
+
+    int OnRun() override {
+        TSApp::OnRun();
+        return exitcode;
+    }
+
+    wxString RunFile(const wxString &filename) {
+        wxString result = L"{\"file\": \"" + Escape(filename) + L"\"";
+        auto filebytes = wxFileName::GetSize(filename);
+        if (filebytes == wxInvalidSize) {
+            exitcode = 1;
+            return result + L", \"error\": \"Cannot open file.\"}";
+        }
+        auto tmpfilename = wxFileName::CreateTempFileName(L"treesheets-bench");
+        wxBitmap bm(viewxs, viewys, 24);
+        wxMemoryDC mdc(bm);
+        Samples load, layoutcold, layoutwarm, render, search, filter, save, close;
+        size_t numcells = 0, textbytes = 0, matches = 0;
+        loop(it, iterations) {
+            auto start = chrono::steady_clock::now();
+            // Reload semantics: skip the already-open and autosave prompts.
+            auto err = sys->LoadDB(filename, true);
+            if (*err) {
+                exitcode = 1;
+                wxRemoveFile(tmpfilename);
+                return result + L", \"error\": \"" + Escape(err) + L"\"}";
+            }
+            load.Add(start);
+            auto doc = frame->GetCurrentTab()->doc;
+
+            doc->CollectCells(doc->root);
+            numcells = doc->itercells.size();
+            textbytes = 0;
+            for (auto c : doc->itercells) textbytes += c->text.GetText().Len();
+
+            doc->scrollx = doc->scrolly = 0;
+            doc->maxx = viewxs;
+            doc->maxy = viewys;
+            start = chrono::steady_clock::now();
+            doc->root->ResetChildren();
+            doc->Layout(mdc);
+            layoutcold.Add(start);
+            start = chrono::steady_clock::now();
+            doc->Layout(mdc);
+            layoutwarm.Add(start);
+            start = chrono::steady_clock::now();
+            doc->Render(mdc);
+            render.Add(start);
+
+            sys->SetSearchString(sys->casesensitivesearch ? searchstring : searchstring.Lower());
+            start = chrono::steady_clock::now();
+            Cell *cur = nullptr;
+            loop(i, searchsteps) {
+                cur = doc->NextSearchMatch(cur, false);
+                if (!cur) break;
+            }
+            search.Add(start);
+            start = chrono::steady_clock::now();
+            doc->SetSearchFilter(true);
+            doc->WaitForFilter();
+            filter.Add(start);
+            matches = 0;
+            for (auto c : doc->itercells) matches += !c->text.filtered;
+            doc->SetSearchFilter(false);
+            sys->SetSearchString(wxEmptyString);
+
+            auto origfilename = doc->filename;
+            doc->filename = tmpfilename;
+            start = chrono::steady_clock::now();
+            doc->SaveDB(nullptr, true);
+            save.Add(start);
+            wxRemoveFile(sys->TmpName(tmpfilename));
+            doc->filename = origfilename;
+
+            start = chrono::steady_clock::now();
+            frame->notebook->DeletePage(frame->notebook->GetSelection());
+            close.Add(start);
+        }
+        wxRemoveFile(tmpfilename);
+
+        auto persec = [](double amount, const Samples &s) {
+            return s.Min() > 0 ? amount * 1000.0 / s.Min() : 0.0;
+        };
+        auto mb = filebytes.ToDouble() / (1024.0 * 1024.0);
+        result += wxString::Format(
+            L", \"bytes\": %s, \"cells\": %llu, \"characters\": %llu, \"matches\": %llu",
+            filebytes.ToString(), (unsigned long long)numcells, (unsigned long long)textbytes,
+            (unsigned long long)matches);
+        result += L",\n     \"load_ms\": " + load.JSON() + L", \"layout_cold_ms\": " +
+                  layoutcold.JSON() + L", \"layout_warm_ms\": " + layoutwarm.JSON() +
+                  L",\n     \"render_ms\": " + render.JSON() + L", \"search_ms\": " +
+                  search.JSON() + L", \"filter_ms\": " + filter.JSON() +
+                  L",\n     \"save_ms\": " + save.JSON() + L", \"close_ms\": " + close.JSON();
+        result += wxString::Format(
+            L",\n     \"load_mb_per_s\": %.3f, \"save_mb_per_s\": %.3f, "
+            L"\"layout_cells_per_s\": %.0f, \"filter_cells_per_s\": %.0f, "
+            L"\"peak_rss_bytes\": %llu}",
+            persec(mb, load), persec(mb, save), persec(numcells, layoutcold),
+            persec(numcells, filter), (unsigned long long)PeakRSS());
+        return result;
+    }
+
+    // Synthetic documents: deterministic for a given seed, since mt19937 output is fully
+    // specified while the std distributions are not.
+    struct Random {
+        mt19937 rng;
+        Random(unsigned long seed) : rng(seed) {}
+        int operator()(int n) { return static_cast<int>(rng() % n); }
+    };
+
+    wxString Words(Random &rnd, int n) {
+        static const wxChar *syllables[] = {L"ka", L"lo", L"mi", L"ne", L"ru", L"sa", L"ti",
+                                            L"vo", L"da", L"pe", L"zu", L"ho", L"an", L"el",
+                                            L"or", L"is", L"um", L"tree", L"sheet", L"grid"};
+        wxString s;
+        loop(i, n) {
+            if (i) s += L' ';
+            loop(j, 1 + rnd(3)) s += syllables[rnd(sizeof(syllables) / sizeof(syllables[0]))];
+        }
+        return s;
+    }
+
+    void Fill(Cell *c, Random &rnd, const wxString &t) {
+        c->text.SetText(t);
+        // Fixed timestamps, so the edit filters behave the same on every generated copy.
+        c->text.lastedit = wxDateTime(wxLongLong(1700000000000LL + rnd(1 << 30) * 1000LL));
+    }
+
+    Cell *NewRoot(int xs, int ys) {
+        auto root = new Cell(nullptr, nullptr, CT_DATA, new Grid(xs, ys));
+        root->cellcolor = 0xCCDCE2;
+        root->grid->InitCells();
+        return root;
+    }
+
+    const wxChar *Generate() {
+        Random rnd(seed);
+        Cell *root = nullptr;
+        if (shape == L"chain") {
+            // One long path of nested 1x2 grids, the second cell being a leaf.
+            auto depth = count ? count : 1000;
+            root = NewRoot(1, 1);
+            auto c = root->grid->C(0, 0);
+            loop(i, depth) {
+                Fill(c, rnd, wxString::Format(L"%d ", i) + Words(rnd, 1 + rnd(4)));
+                if (i == depth - 1) break;
+                auto g = c->AddGrid(1, 2);
+                Fill(g->C(0, 1), rnd, Words(rnd, 1 + rnd(8)));
+                c = g->C(0, 0);
+            }
+        } else if (shape == L"table") {
+            auto rows = count ? count : 100000;
+            const int cols = 6;
+            root = NewRoot(cols, rows + 1);
+            loop(x, cols) {
+                auto h = root->grid->C(x, 0);
+                Fill(h, rnd, Words(rnd, 1));
+                h->text.stylebits = STYLE_BOLD;
+            }
+            loop(y, rows) {
+                Fill(root->grid->C(0, y + 1), rnd, wxString::Format(L"%d", y + 1));
+                Fill(root->grid->C(1, y + 1), rnd, Words(rnd, 1 + rnd(3)));
+                Fill(root->grid->C(2, y + 1), rnd, Words(rnd, 3 + rnd(12)));
+                Fill(root->grid->C(3, y + 1), rnd,
+                     wxString::Format(L"%d.%02d", rnd(100000), rnd(100)));
+                Fill(root->grid->C(4, y + 1), rnd,
+                     wxString::Format(L"20%02d-%02d-%02d", rnd(30), 1 + rnd(12), 1 + rnd(28)));
+                Fill(root->grid->C(5, y + 1), rnd, rnd(4) ? wxString() : Words(rnd, 1));
+            }
+        } else if (shape == L"wide") {
+            auto cols = count ? count : 1000;
+            const int rows = 20;
+            root = NewRoot(cols, rows);
+            foreachcellingrid(c, root->grid) Fill(c, rnd, Words(rnd, 1 + rnd(3)));
+        } else if (shape == L"text") {
+            // Paragraph cells, every 10th one with a nested column of short notes.
+            auto cells = count ? count : 10000;
+            root = NewRoot(1, cells);
+            loop(y, cells) {
+                auto c = root->grid->C(0, y);
+                Fill(c, rnd, Words(rnd, 20 + rnd(400)));
+                if (y % 10 == 0) {
+                    auto g = c->AddGrid(1, 3);
+                    loop(i, 3) Fill(g->C(0, i), rnd, Words(rnd, 5 + rnd(40)));
+                }
+            }
+        } else if (shape == L"images") {
+            // Distinct noise images next to captions.
+            auto images = count ? count : 1000;
+            root = NewRoot(2, images);
+            loop(y, images) {
+                wxImage im(64 + rnd(64), 48 + rnd(48));
+                auto rgb = im.GetData();
+                loop(i, im.GetWidth() * im.GetHeight() * 3) rgb[i] = static_cast<uchar>(rnd(256));
+                auto buffer = ConvertWxImageToBuffer(im, wxBITMAP_TYPE_PNG);
+                root->grid->C(0, y)->text.image =
+                    sys->imagelist[sys->AddImageToList(1.0, std::move(buffer), 'I')].get();
+                Fill(root->grid->C(1, y), rnd, Words(rnd, 2 + rnd(10)));
+            }
+        } else {
+            return _(L"Unknown shape.");
+        }
+
+        auto doc = sys->NewTabDoc(true);
+        doc->InitWith(root, outfilename, nullptr, 1, 1);
+        auto success = false;
+        auto err = doc->SaveDB(&success);
+        return success ? L"" : err;
+    }
+
+    wxString Escape(const wxString &s) {
+        wxString r;
+        for (auto ch : s) {
+            if (ch == '"' || ch == '\\') r += L'\\';
+            if (ch >= ' ') r += ch;
+        }
+        return r;
+    }
+
+    size_t PeakRSS() {
+        #ifdef WIN32
+            PROCESS_MEMORY_COUNTERS pmc;
+            if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+            return pmc.PeakWorkingSetSize;
+        #else
+            rusage ru;
+            if (getrusage(RUSAGE_SELF, &ru)) return 0;
+            #ifdef __WXMAC__
+                return ru.ru_maxrss;  // bytes
+            #else
+                return ru.ru_maxrss * 1024;  // kilobytes
+            #endif
+        #endif
+    }
+};
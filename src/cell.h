@@ -14,13 +14,10 @@ enum { CT_DATA = 0, CT_CODE, CT_VARD, CT_VIEWH, CT_VARU, CT_VIEWV };
 enum { DS_GRID, DS_BLOBSHIER, DS_BLOBLINE };
 
 /**
-    The Cell structure represents the editable cells in the sheet.
-
-    They are mutable structures containing a text and grid object. Along with
-    formatting information.
+    Where and how big a cell was drawn by the last layout. This is a cache that can be rebuilt
+    from the model at any time, so it is kept out of Cell and freed for documents nobody looks at.
 */
-struct Cell {
-    Cell *parent;
+struct CellLayout {
     int sx {0};
     int sy {0};
     int ox {0};
@@ -30,13 +27,46 @@ struct Cell {
     int ycenteroff {0};
     int txs {0};
     int tys {0};
+    bool tiny {false};
+};
+
+// Totals over a cell and everything below it, cached by each grid, see Grid::Stats.
+struct CellStats {
+    size_t cells {0};
+    size_t chars {0};
+    size_t words {0};
+    size_t bytes {0};  // estimated memory use
+    size_t images {0};
+
+    CellStats &operator+=(const CellStats &o) {
+        cells += o.cells;
+        chars += o.chars;
+        words += o.words;
+        bytes += o.bytes;
+        images += o.images;
+        return *this;
+    }
+};
+
+/**
+    The Cell structure represents the editable cells in the sheet.
+
+    They are mutable structures containing a text and grid object. Along with
+    formatting information.
+*/
+struct Cell : Pooled<Cell> {
+    Cell *parent;
+    unique_ptr<CellLayout> layout;  // allocated by the first layout, see L and DropLayout
+    // position in parent->grid, kept current by Grid::IndexCells, see Grid::FindCell
+    int gridx {0};
+    int gridy {0};
     int celltype;
     Text text;
     Grid *grid;
     uint cellcolor {g_cellcolor_default};
     uint actualcellcolor {g_cellcolor_default};
     uint textcolor {g_textcolor_default};
-    bool tiny {false};
+    bool childdirty {false};  // cells in grid need relayout, see Grid::MarkDirty
     bool verticaltextandgrid {true};
     wxUint8 drawstyle {DS_GRID};
 
@@ -53,14 +83,31 @@ struct Cell {
     }
 
     ~Cell() { DELETEP(grid); }
+
+    CellLayout &L() {
+        if (!layout) layout = make_unique<CellLayout>();
+        return *layout;
+    }
+    const CellLayout &L() const {
+        static const CellLayout none;
+        return layout ? *layout : none;
+    }
+
+    void DropLayout() {
+        layout.reset();
+        childdirty = false;
+        if (grid) grid->DropLayout();
+    }
+
     void Clear() {
+        StatsChanged();
         DELETEP(grid);
-        text.t.Clear();
+        text.SetText(wxEmptyString);
         text.image = nullptr;
         Reset();
     }
 
-    bool HasText() const { return !text.t.empty(); }
+    bool HasText() const { return !text.GetText().empty(); }
     bool HasTextSize() const { return HasText() || text.relsize; }
     bool HasTextState() const { return HasTextSize() || text.image; }
     bool HasHeader() const { return HasText() || text.image; }
@@ -81,57 +128,75 @@ struct Cell {
         return rs;
     }
 
-    size_t EstimatedMemoryUse() {
-        return sizeof(Cell) + text.EstimatedMemoryUse() + (grid ? grid->EstimatedMemoryUse() : 0);
+    size_t EstimatedMemoryUse() const { return Stats().bytes; }
+
+    CellStats Stats() const {
+        CellStats s;
+        s.cells = 1;
+        s.chars = text.GetText().Len();
+        s.words = text.GetText().Words();
+        s.bytes = sizeof(Cell) + text.EstimatedMemoryUse();
+        s.images = text.image != nullptr;
+        if (grid) s += grid->Stats();
+        return s;
+    }
+
+    // Call when this cell changes, so the grids above count it again. Its text does this
+    // itself, see Text::SetText, and so do changes to its grid, see Grid::StatsChanged.
+    void StatsChanged() const {
+        for (auto p = parent; p; p = p->parent) p->grid->statsdirty = true;
     }
 
     void Layout(Document *doc, wxDC &dc, int depth, int maxcolwidth, bool forcetiny) {
-        tiny = text.filtered && !grid || forcetiny ||
-               doc->PickFont(dc, depth, text.relsize, text.stylebits);
+        auto &l = L();
+        l.tiny = text.filtered && !grid || forcetiny ||
+                 doc->PickFont(dc, depth, text.relsize, text.stylebits);
         int ixs = 0, iys = 0;
-        if (!tiny) sys->ImageSize(text.DisplayImage(), ixs, iys);
+        if (!l.tiny) text.ImageSize(ixs, iys);
         int leftoffset = 0;
         if (!HasText()) {
             if (!ixs || !iys) {
-                sx = sy = tiny ? 1 : dc.GetCharHeight();
+                l.sx = l.sy = l.tiny ? 1 : dc.GetCharHeight();
             } else {
                 leftoffset = dc.GetCharHeight();
             }
         } else {
-            text.TextSize(dc, sx, sy, tiny, leftoffset, maxcolwidth);
+            text.TextSize(doc, dc, l.sx, l.sy, l.tiny, leftoffset, maxcolwidth);
         }
         if (ixs && iys) {
-            sx += ixs + 2;
-            sy = max(iys + 2, sy);
+            l.sx += ixs + 2;
+            l.sy = max(iys + 2, l.sy);
         }
-        text.extent = sx + depth * dc.GetCharHeight();
-        txs = sx;
-        tys = sy;
+        text.extent = l.sx + depth * dc.GetCharHeight();
+        l.txs = l.sx;
+        l.tys = l.sy;
         if (GridShown(doc)) {
             if (HasHeader()) {
                 if (verticaltextandgrid) {
-                    int osx = sx;
-                    if (drawstyle == DS_BLOBLINE && !tiny) sy += 4;
-                    grid->Layout(doc, dc, depth, sx, sy, leftoffset, sy, tiny || forcetiny);
-                    sx = max(sx, osx);
+                    int osx = l.sx;
+                    if (drawstyle == DS_BLOBLINE && !l.tiny) l.sy += 4;
+                    grid->Layout(doc, dc, depth, l.sx, l.sy, leftoffset, l.sy,
+                                 l.tiny || forcetiny);
+                    l.sx = max(l.sx, osx);
                 } else {
-                    int osy = sy;
-                    if (drawstyle == DS_BLOBLINE && !tiny) sx += 18;
-                    grid->Layout(doc, dc, depth, sx, sy, sx, 0, tiny || forcetiny);
-                    sy = max(sy, osy);
+                    int osy = l.sy;
+                    if (drawstyle == DS_BLOBLINE && !l.tiny) l.sx += 18;
+                    grid->Layout(doc, dc, depth, l.sx, l.sy, l.sx, 0, l.tiny || forcetiny);
+                    l.sy = max(l.sy, osy);
                 }
             } else
-                tiny = grid->Layout(doc, dc, depth, sx, sy, 0, 0, forcetiny);
+                l.tiny = grid->Layout(doc, dc, depth, l.sx, l.sy, 0, 0, forcetiny);
         }
-        ycenteroff = !verticaltextandgrid ? (sy - tys) / 2 : 0;
-        if (!tiny) {
-            sx += g_margin_extra * 2;
-            sy += g_margin_extra * 2;
+        l.ycenteroff = !verticaltextandgrid ? (l.sy - l.tys) / 2 : 0;
+        if (!l.tiny) {
+            l.sx += g_margin_extra * 2;
+            l.sy += g_margin_extra * 2;
         }
     }
 
     void Render(Document *doc, int bx, int by, wxDC &dc, int depth, int ml, int mr, int mt, int mb,
                 int maxcolwidth, int cell_margin) {
+        auto &l = L();
         // Choose color from celltype (program operations)
         switch (celltype) {
             case CT_VARD: actualcellcolor = 0xFF8080; break;
@@ -155,9 +220,9 @@ struct Cell {
         }
 
         if (drawstyle == DS_GRID && actualcellcolor != parentcolor) {
-            DrawRectangle(dc, actualcellcolor, bx - ml, by - mt, sx + ml + mr, sy + mt + mb);
+            DrawRectangle(dc, actualcellcolor, bx - ml, by - mt, l.sx + ml + mr, l.sy + mt + mb);
         }
-        if (drawstyle != DS_GRID && HasContent() && !tiny) {
+        if (drawstyle != DS_GRID && HasContent() && !l.tiny) {
             if (actualcellcolor == parentcolor) {
                 auto cp = (uchar *)&actualcellcolor;
                 loop(i, 4) cp[i] = cp[i] * 850 / 1000;
@@ -166,20 +231,22 @@ struct Cell {
             dc.SetPen(wxPen(LightColor(actualcellcolor)));
 
             if (drawstyle == DS_BLOBSHIER)
-                dc.DrawRoundedRectangle(bx - cell_margin, by - cell_margin, minx + cell_margin * 2,
-                                        miny + cell_margin * 2, sys->roundness);
+                dc.DrawRoundedRectangle(bx - cell_margin, by - cell_margin,
+                                        l.minx + cell_margin * 2, l.miny + cell_margin * 2,
+                                        sys->roundness);
             else if (HasHeader())
                 dc.DrawRoundedRectangle(bx - cell_margin + g_margin_extra / 2,
-                                        by - cell_margin + ycenteroff + g_margin_extra / 2,
-                                        txs + cell_margin * 2 + g_margin_extra,
-                                        tys + cell_margin * 2 + g_margin_extra, sys->roundness);
+                                        by - cell_margin + l.ycenteroff + g_margin_extra / 2,
+                                        l.txs + cell_margin * 2 + g_margin_extra,
+                                        l.tys + cell_margin * 2 + g_margin_extra, sys->roundness);
             // FIXME: this half a g_margin_extra is a bit of hack
         }
         dc.SetTextBackground(wxColour(LightColor(actualcellcolor)));
         int xoff = verticaltextandgrid ? 0 : text.extent - depth * dc.GetCharHeight();
-        int yoff = text.Render(doc, bx, by + ycenteroff, depth, dc, xoff, maxcolwidth);
+        int yoff = text.Render(doc, bx, by + l.ycenteroff, depth, dc, xoff, maxcolwidth);
         yoff = verticaltextandgrid ? yoff : 0;
-        if (GridShown(doc)) grid->Render(doc, bx, by, dc, depth, sx - xoff, sy - yoff, xoff, yoff);
+        if (GridShown(doc))
+            grid->Render(doc, bx, by, dc, depth, l.sx - xoff, l.sy - yoff, xoff, yoff);
     }
 
     void CloneStyleFrom(Cell const *o) {
@@ -199,9 +266,46 @@ struct Cell {
         return c;
     }
 
-    bool IsInside(int x, int y) const { return x >= 0 && y >= 0 && x < sx && y < sy; }
-    int GetX(Document *doc) const { return ox + (parent ? parent->GetX(doc) : doc->hierarchysize); }
-    int GetY(Document *doc) const { return oy + (parent ? parent->GetY(doc) : doc->hierarchysize); }
+    // A copy for undo of changes that only touch sel in this cell's grid, see Document::AddUndo.
+    unique_ptr<Cell> ClonePart(const Selection &sel) const {
+        auto c = make_unique<Cell>(nullptr, this, celltype, new Grid(grid->xs, grid->ys));
+        c->text = text;
+        c->text.cell = c.get();
+        grid->ClonePart(c->grid, sel);
+        return c;
+    }
+
+    void SwapPart(Cell *o, const Selection &sel) {
+        SwapState(o);
+        grid->SwapPart(o->grid, sel);
+    }
+
+    // A copy of just this cell, without its grid, see Document::AddUndoCell.
+    unique_ptr<Cell> CloneState() const {
+        auto c = make_unique<Cell>(nullptr, this, celltype);
+        c->text = text;
+        c->text.cell = c.get();
+        return c;
+    }
+
+    void SwapState(Cell *o) {
+        swap_(celltype, o->celltype);
+        swap_(cellcolor, o->cellcolor);
+        swap_(textcolor, o->textcolor);
+        swap_(verticaltextandgrid, o->verticaltextandgrid);
+        swap_(drawstyle, o->drawstyle);
+        swap_(text, o->text);
+        text.cell = this;
+        o->text.cell = o;
+    }
+
+    bool IsInside(int x, int y) const { return x >= 0 && y >= 0 && x < L().sx && y < L().sy; }
+    int GetX(Document *doc) const {
+        return L().ox + (parent ? parent->GetX(doc) : doc->hierarchysize);
+    }
+    int GetY(Document *doc) const {
+        return L().oy + (parent ? parent->GetY(doc) : doc->hierarchysize);
+    }
     int Depth() const { return parent ? parent->Depth() + 1 : 0; }
     Cell *Parent(int i) { return i ? parent->Parent(i - 1) : this; }
     Cell *SetParent(Cell *g) {
@@ -281,9 +385,9 @@ struct Cell {
                                                       : L"font-family: sans-serif;";
             if (!inheritstyle || cellcolor != (parent ? parent->cellcolor : doc->Background()))
                 style += wxString::Format(L"background-color: #%06X;", SwapColor(cellcolor));
-            auto exporttextcolor = IsTag(doc) ? doc->tags[text.t] : textcolor;
+            auto exporttextcolor = IsTag(doc) ? doc->tags[text.GetText()] : textcolor;
             auto parenttextcolor =
-                parent ? parent->IsTag(doc) ? doc->tags[parent->text.t] : parent->textcolor
+                parent ? parent->IsTag(doc) ? doc->tags[parent->text.GetText()] : parent->textcolor
                        : 0x000000;
             if (!inheritstyle || exporttextcolor != parenttextcolor)
                 style += wxString::Format(L"color: #%06X;", SwapColor(exporttextcolor));
@@ -291,11 +395,11 @@ struct Cell {
                                         : wxString(L"<td style=\"") + style + wxString(L"\">"));
             str.Append(L' ', indent);
             str.Append(L"</td>\n");
-        } else if (format == A_EXPHTMLB && (text.t.Len() || grid) && this != root) {
+        } else if (format == A_EXPHTMLB && (text.GetText().Len() || grid) && this != root) {
             str.Prepend(L"<li>");
             str.Append(L' ', indent);
             str.Append(L"</li>\n");
-        } else if (format == A_EXPHTMLO && text.t.Len()) {
+        } else if (format == A_EXPHTMLO && text.GetText().Len()) {
             wxString h = wxString(L"h") + wxChar(L'0' + indent / 2) + L">";
             str.Prepend(L"<" + h);
             str.Append(L' ', indent);
@@ -310,34 +414,52 @@ struct Cell {
         if (grid) grid->RelSize(dir, zoomdepth);
     }
 
-    void Reset() { ox = oy = sx = sy = minx = miny = ycenteroff = 0; }
+    void Reset() {
+        if (layout) {
+            auto &l = *layout;
+            l.ox = l.oy = l.sx = l.sy = l.minx = l.miny = l.ycenteroff = 0;
+        }
+        if (grid) grid->relsizedirty = true;
+    }
     void ResetChildren() {
         Reset();
         if (grid) grid->ResetChildren();
     }
 
+    // Lays this cell out again from scratch, its ancestors only as far as its size changes.
     void ResetLayout() {
+        for (auto c = this; c->parent; c = c->parent) c->parent->grid->MarkDirty(c);
         Reset();
-        if (parent) parent->ResetLayout();
     }
 
     void LazyLayout(Document *doc, wxDC &dc, int depth, int maxcolwidth, bool forcetiny) {
-        if (sx == 0) {
+        auto &l = L();
+        if (l.sx == 0 ||
+            childdirty && !(GridShown(doc) &&
+                            grid->UpdateLayout(doc, dc, depth,
+                                               HasHeader() ? l.tiny || forcetiny : forcetiny))) {
             Layout(doc, dc, depth, maxcolwidth, forcetiny);
-            minx = sx;
-            miny = sy;
+            l.minx = l.sx;
+            l.miny = l.sy;
         } else {
-            sx = minx;
-            sy = miny;
+            l.sx = l.minx;
+            l.sy = l.miny;
         }
+        childdirty = false;
     }
 
     void AddUndo(Document *doc) {
         ResetLayout();
         doc->AddUndo(this);
     }
+    // For changes limited to sel in this cell's grid, which must not change the grid's size.
+    void AddUndo(Document *doc, const Selection &sel) {
+        ResetLayout();
+        doc->AddUndo(this, true, &sel);
+    }
 
-    void Save(wxDataOutputStream &dos, Cell *ocs) const {
+    void Save(wxDataOutputStream &dos, const ImageIndex &images, const Cell *ocs,
+              bool withcells = true) const {
         dos.Write8(celltype);
         dos.Write32(cellcolor);
         dos.Write32(textcolor);
@@ -346,12 +468,12 @@ struct Cell {
         if (HasTextState()) {
             cellflags |= grid ? TS_BOTH : TS_TEXT;
             dos.Write8(cellflags);
-            text.Save(dos);
-            if (grid) grid->Save(dos, ocs);
+            text.Save(dos, images);
+            if (grid) grid->Save(dos, images, ocs, withcells);
         } else if (grid) {
             cellflags |= TS_GRID;
             dos.Write8(cellflags);
-            grid->Save(dos, ocs);
+            grid->Save(dos, images, ocs, withcells);
         } else {
             cellflags |= TS_NEITHER;
             dos.Write8(cellflags);
@@ -362,28 +484,31 @@ struct Cell {
         if (!grid) {
             grid = new Grid(x, y, this);
             grid->InitCells(this);
+            StatsChanged();
             if (parent) grid->CloneStyleFrom(parent->grid);
         }
         return grid;
     }
 
-    Cell *LoadGrid(wxDataInputStream &dis, int &numcells, int &textbytes, Cell *&ics) {
+    Cell *LoadGrid(wxDataInputStream &dis, const LoadContext &lc, int &numcells, int &textbytes,
+                   Cell *&ics, bool withcells) {
         int xs = dis.Read32();
         auto g = new Grid(xs, dis.Read32());
         grid = g;
         g->cell = this;
-        if (!g->LoadContents(dis, numcells, textbytes, ics)) return nullptr;
+        if (!g->LoadContents(dis, lc, numcells, textbytes, ics, withcells)) return nullptr;
         return this;
     }
 
-    static Cell *LoadWhich(wxDataInputStream &dis, Cell *_p, int &numcells, int &textbytes, Cell *&ics) {
+    static Cell *LoadWhich(wxDataInputStream &dis, const LoadContext &lc, Cell *_p,
+                           int &numcells, int &textbytes, Cell *&ics, bool withcells = true) {
         auto c = new Cell(_p, nullptr, dis.Read8());
         numcells++;
-        if (sys->versionlastloaded >= 8) {
+        if (lc.version >= 8) {
             c->cellcolor = dis.Read32() & 0xFFFFFF;
             c->textcolor = dis.Read32() & 0xFFFFFF;
         }
-        if (sys->versionlastloaded >= 15) c->drawstyle = dis.Read8();
+        if (lc.version >= 15) c->drawstyle = dis.Read8();
         int ts = dis.Read8();
         if (ts & TS_SELECTION_MASK) {
             ics = c;
@@ -392,10 +517,10 @@ struct Cell {
         switch (ts) {
             case TS_BOTH:
             case TS_TEXT:
-                c->text.Load(dis);
-                textbytes += c->text.t.Len();
+                c->text.Load(dis, lc);
+                textbytes += c->text.GetText().Len();
                 if (ts == TS_TEXT) return c;
-            case TS_GRID: return c->LoadGrid(dis, numcells, textbytes, ics);
+            case TS_GRID: return c->LoadGrid(dis, lc, numcells, textbytes, ics, withcells);
             case TS_NEITHER: return c;
             default: return nullptr;
         }
@@ -415,9 +540,12 @@ struct Cell {
                 textcolor = original->textcolor;
                 text.stylebits = original->text.stylebits;
             }
-            text.Insert(document, original->text.t, selection, false);
+            text.Insert(document, original->text.GetText(), selection, false);
+        }
+        if (original->text.image) {
+            text.image = original->text.image;
+            StatsChanged();
         }
-        if (original->text.image) text.image = original->text.image;
         if (original->grid) {
             auto gridclone = new Grid(original->grid->xs, original->grid->ys);
             gridclone->cell = this;
@@ -426,23 +554,24 @@ struct Cell {
             original = nullptr;
             DELETEP(grid);  // FIXME: could merge instead?
             grid = gridclone;
+            StatsChanged();
             if (!HasText())
                 grid->MergeWithParent(parent->grid, selection, document);  // deletes grid/this.
         }
     }
 
-    Cell *FindNextSearchMatch(const wxString &s, Cell *best, Cell *selected, bool &lastwasselected,
-                              bool reverse) {
-        if (reverse && grid)
-            best = grid->FindNextSearchMatch(s, best, selected, lastwasselected, reverse);
-        if ((sys->casesensitivesearch ? text.t.Find(s) : text.t.Lower().Find(s)) >= 0) {
-            if (lastwasselected) best = this;
-            lastwasselected = false;
+    // Whether this cell comes before o in the order of CollectCells.
+    bool Before(const Cell *o) const {
+        vector<const Cell *> a, b;
+        for (auto c = this; c; c = c->parent) a.push_back(c);
+        for (auto c = o; c; c = c->parent) b.push_back(c);
+        while (a.size() > 1 && b.size() > 1 && a[a.size() - 2] == b[b.size() - 2]) {
+            a.pop_back();
+            b.pop_back();
         }
-        if (selected == this) lastwasselected = true;
-        if (!reverse && grid)
-            best = grid->FindNextSearchMatch(s, best, selected, lastwasselected, reverse);
-        return best;
+        if (a.size() == 1 || b.size() == 1) return a.size() < b.size();  // an ancestor is first
+        auto x = a[a.size() - 2], y = b[b.size() - 2];
+        return x->gridy != y->gridy ? x->gridy < y->gridy : x->gridx < y->gridx;
     }
 
     Cell *FindNextFilterMatch(Cell *best, Cell *selected, bool &lastwasselected) {
@@ -463,7 +592,7 @@ struct Cell {
             return best;
         }
         if (image ? link->text.image == text.image
-                  : link->text.ToText(0, sel, A_EXPTEXT) == text.t) {
+                  : text.GetText() == link->text.ToText(0, sel, A_EXPTEXT)) {
             if (link->text.stylebits != text.stylebits || link->cellcolor != cellcolor ||
                 link->textcolor != textcolor) {
                 if (!stylematch) best = nullptr;
@@ -479,13 +608,15 @@ struct Cell {
         return best;
     }
 
-    void FindReplaceAll(const wxString &s, const wxString &ls) {
-        if (grid) grid->FindReplaceAll(s, ls);
+    void FindReplaceAll(Document *doc, const wxString &s, const wxString &ls) {
+        if (grid) grid->FindReplaceAll(doc, s, ls);
+        if (!text.IsInSearch()) return;
+        doc->AddUndoCell(this);
         text.ReplaceStr(s, ls);
     }
 
     Cell *FindExact(const wxString &s) {
-        return text.t == s ? this : (grid ? grid->FindExact(s) : nullptr);
+        return text.GetText() == s ? this : (grid ? grid->FindExact(s) : nullptr);
     }
 
     void ImageRefCount(bool includefolded) {
@@ -493,6 +624,11 @@ struct Cell {
         if (text.image) text.image->trefc++;
     }
 
+    void MarkImages() {
+        if (grid) grid->MarkImages();
+        if (text.image) text.image->trefc++;
+    }
+
     void SetBorder(int width) {
         if (grid) grid->user_grid_outer_spacing = width;
     }
@@ -502,7 +638,7 @@ struct Cell {
             case A_CELLCOLOR: cellcolor = color; break;
             case A_TEXTCOLOR:
                 if (IsTag(doc)) {
-                    doc->tags[text.t] = color;
+                    doc->tags[text.GetText()] = color;
                 } else {
                     textcolor = color;
                 }
@@ -520,7 +656,7 @@ struct Cell {
         if (grid) grid->SetGridTextLayout(ds, vert, noset, grid->SelectAll());
     }
 
-    bool IsTag(Document *doc) { return doc->tags.contains(text.t); }
+    bool IsTag(Document *doc) { return doc->tags.contains(text.GetText()); }
     void MaxDepthLeaves(int curdepth, int &maxdepth, int &leaves) {
         if (curdepth > maxdepth) maxdepth = curdepth;
         if (grid)
@@ -541,8 +677,7 @@ struct Cell {
 
     Cell *Graph() {
         auto n = text.GetNum();
-        text.t.Clear();
-        text.t.Append(L'|', n);
+        text.SetText(wxString(L'|', n));
         return this;
     }
 };
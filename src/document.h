@@ -1,11 +1,81 @@
+// A single cell as it was before a change, without its grid, see Document::AddUndoCell.
+struct UndoCell {
+    vector<Selection> path;
+    unique_ptr<Cell> before;
+};
+
+// Where the state of an undo item is kept, see Document::TrimUndo.
+enum { UNDO_LIVE, UNDO_PACKED, UNDO_SPILLED };
+
 struct UndoItem {
     vector<Selection> path;
     vector<Selection> selpath;
     Selection sel;
     unique_ptr<Cell> clone;
+    // When set, clone holds only the cells in part of its grid, the rest is shared with the
+    // document, see Cell::ClonePart.
+    bool partial {false};
+    Selection part;
+    // When set, there is no clone but only the cells changes were made to, anywhere in the
+    // document, see Document::AddSparseUndo.
+    bool sparse {false};
+    vector<UndoCell> cells;
     size_t estimated_size {0};
     uintptr_t cloned_from;  // May be dead.
     int generation {0};
+    // Once packed, clone and cells are deflated into packed, with the images they use, and once
+    // spilled, packed is in Document::undofile instead.
+    int tier {UNDO_LIVE};
+    vector<uint8_t> packed;
+    vector<Image *> images;
+    wxFileOffset spilloffset {0};
+    size_t spillsize {0};
+
+    void MarkImages() const {
+        if (clone) clone->MarkImages();
+        for (auto &uc : cells) uc.before->MarkImages();
+        for (auto image : images) image->trefc++;
+    }
+};
+
+// Everything SaveDB writes, taken on the UI thread so that Document::WriteDB can run on another.
+struct SaveJob {
+    wxString filename;
+    wxString savefilename;
+    wxString bakname;
+    bool istempfile;
+    int page;
+    bool *success;
+    uint64_t changes;  // Document::changes and undolist size when the cells were serialized
+    size_t undosize;
+    wxLongLong start;
+    int xs, ys, zoomlevel;
+    bool background {false};
+    struct Blob {
+        char type;
+        double display_scale;
+        shared_ptr<const vector<uint8_t>> data;  // shared with the Image, not copied
+    };
+    vector<Blob> images;
+    ImageIndex imageindex;  // where each image went in images
+    vector<vector<uint8_t>> cellchunks;  // not deflated yet, see Document::SerializeDB
+    vector<wxUint32> chunkcells;         // how many cells of the root's grid each chunk holds
+    map<wxString, uint> tags;
+    bool journal {false};  // appended to the journal rather than written in full
+};
+
+enum { SAVE_OK, SAVE_CANTOPEN, SAVE_ZLIB };
+
+enum { CHUNK_BYTES = 256 * 1024 };  // estimated memory use of the cells in a save chunk
+
+// A search filter running on the workers, see Document::SetSearchFilter.
+struct FilterPass {
+    uint generation;
+    std::string search;  // UTF-8, see Text::Matches
+    bool casesensitive;
+    vector<Cell *> cells;
+    vector<uchar> filtered;  // by index into cells
+    std::atomic<size_t> chunksleft;
 };
 
 struct Document {
@@ -38,7 +108,19 @@ struct Document {
     long lastmodsinceautosave {0};
     long undolistsizeatfullsave {0};
     long lastsave {wxGetLocalTime()};
+    long lastdrawn {0};  // 0 while there is no layout to drop, see DropLayout
+    wxFile undofile;  // older undo items, see SpillUndo
+    wxString undofilename;
+    bool undotrimpending {false};  // see TrimUndo
     bool modified {false};
+    uint64_t changes {0};  // counts edits and undos, tells SaveDone whether the save is current
+    bool saving {false};
+    // The subtree that holds every change since the last save, and the file a journal extends.
+    vector<Selection> journalpath;
+    bool journaldirty {false};
+    wxString journalbase;
+    uint64_t journalbasesize {0};
+    int64_t journalbasetime {0};
     bool tmpsavesuccess {true};
     wxDataObjectComposite *dndobjc {new wxDataObjectComposite()};
     wxTextDataObject *dndobjt {new wxTextDataObject()};
@@ -84,10 +166,16 @@ struct Document {
     bool paintscrolltoselection {true};
     double currentviewscale {1.0};
     bool searchfilter {false};
+    std::atomic<uint> filtergeneration {0};  // a newer pass stops the chunks of older ones
+    shared_ptr<FilterPass> filterpass;       // the newest pass until its results are applied
+    vector<std::future<void>> filtering;     // chunks that may still read cells
     int editfilter {0};
     wxDateTime lastmodificationtime;
     map<wxString, uint> tags;
     vector<Cell *> itercells;
+    vector<Cell *> searchmatches;  // see SearchMatches
+    uint searchmatchesgen {0};
+    uint64_t searchmatcheschanges {0};
 
     #define loopcellsin(par, c) \
         CollectCells(par);      \
@@ -109,7 +197,11 @@ struct Document {
         dndobjc->Add(dndobjf);
     }
 
-    ~Document() { DELETEP(root); }
+    ~Document() {
+        for (auto &f : filtering) f.wait();
+        DELETEP(root);
+        CloseUndoFile();
+    }
 
     uint Background() { return root ? root->cellcolor : 0xFFFFFF; }
 
@@ -143,86 +235,317 @@ struct Document {
         UpdateFileName();
     }
 
-    const wxChar *SaveDB(bool *success, bool istempfile = false, int page = -1) {
+    // Writes the cells into job->cellchunks: first the root without the cells of its grid and
+    // the tags, then consecutive cells of the root's grid until they hold about CHUNK_BYTES, so
+    // that a long table of small rows is not split into tiny streams. The chunks are written in
+    // parallel, but this returns only when all are done, as they are read from the live tree.
+    void SerializeDB(SaveJob &job, const Cell *ocs) {
+        vector<std::future<vector<uint8_t>>> writing;
+        auto write = [](auto save) {
+            wxMemoryOutputStream mos;
+            {
+                wxDataOutputStream dos(mos);
+                save(dos);
+            }
+            vector<uint8_t> buf(mos.GetSize());
+            mos.CopyTo(buf.data(), buf.size());
+            return buf;
+        };
+        job.chunkcells = {1};
+        {
+            ThreadPool pool(max(1u, std::thread::hardware_concurrency()));
+            writing.push_back(pool.enqueue([&]() {
+                return write([&](wxDataOutputStream &dos) {
+                    root->Save(dos, job.imageindex, ocs, false);
+                    for (auto &[tag, color] : job.tags) {
+                        dos.WriteString(tag);
+                        dos.Write32(color);
+                    }
+                    dos.WriteString(wxEmptyString);
+                });
+            }));
+            if (auto g = root->grid) {
+                auto n = size_t(g->xs) * g->ys;
+                size_t start = 0, bytes = 0;
+                for (size_t i = 0; i < n; i++) {
+                    bytes += g->C(i % g->xs, i / g->xs)->EstimatedMemoryUse();
+                    if (bytes < CHUNK_BYTES && i + 1 < n) continue;
+                    writing.push_back(pool.enqueue([&, g](size_t start, size_t end) {
+                        return write([&](wxDataOutputStream &dos) {
+                            for (auto j = start; j < end; j++)
+                                g->C(j % g->xs, j / g->xs)->Save(dos, job.imageindex, ocs);
+                        });
+                    }, start, i + 1));
+                    job.chunkcells.push_back(static_cast<wxUint32>(i + 1 - start));
+                    start = i + 1;
+                    bytes = 0;
+                }
+            }
+        }  // wait until all tasks are finished
+        for (auto &f : writing) job.cellchunks.push_back(f.get());
+    }
+
+    // Deflates the chunks of SerializeDB and writes the file, can run on any thread.
+    static int WriteDB(const SaveJob &job) {
+        if (!job.bakname.empty() && ::wxFileExists(job.filename))
+            ::wxRenameFile(job.filename, job.bakname);
+        wxFFileOutputStream fos(job.savefilename);
+        if (!fos.IsOk()) return SAVE_CANTOPEN;
+
+        wxDataOutputStream sos(fos);
+        fos.Write("TSFF", 4);
+        char vers = TS_VERSION;
+        fos.Write(&vers, 1);
+        sos.Write8(job.xs);
+        sos.Write8(job.ys);
+        sos.Write8(job.zoomlevel);
+        for (auto &image : job.images) {
+            fos.PutC(image.type);
+            sos.WriteDouble(image.display_scale);
+            wxInt64 imagelen(image.data->size());
+            sos.Write64(imagelen);
+            fos.Write(image.data->data(), imagelen);
+        }
+
+        vector<std::future<vector<uint8_t>>> deflating;
+        {
+            ThreadPool pool(max(1u, std::thread::hardware_concurrency()));
+            for (auto &cells : job.cellchunks)
+                deflating.push_back(pool.enqueue([&cells]() {
+                    return System::Deflate([&](wxDataOutputStream &dos) {
+                        dos.Write8(cells.data(), cells.size());
+                    });
+                }));
+        }  // wait until all tasks are finished
+        vector<vector<uint8_t>> chunks;
+        for (auto &f : deflating) {
+            chunks.push_back(f.get());
+            if (chunks.back().empty()) return SAVE_ZLIB;
+        }
+        fos.Write("C", 1);
+        sos.Write32(static_cast<wxUint32>(chunks.size()));
+        loopv(i, chunks) {
+            sos.Write64(wxUint64(chunks[i].size()));
+            sos.Write32(job.chunkcells[i]);
+        }
+        for (auto &chunk : chunks) fos.Write(chunk.data(), chunk.size());
+        return fos.IsOk() ? SAVE_OK : SAVE_CANTOPEN;
+    }
+
+    // The cells are serialized on the UI thread and the image data is shared (images replace
+    // their data rather than change it). In the background only deflating and writing are left
+    // to the save thread, so editing can continue meanwhile; SaveDone then runs on the UI thread
+    // when it is finished. There is one save thread for all documents, so a save waits in
+    // WaitForSave for the one before it.
+    const wxChar *SaveDB(bool *success, bool istempfile = false, int page = -1,
+                         bool background = false) {
         if (filename.empty()) return _(L"Save cancelled.");
+        sys->WaitForSave();
+        if (!istempfile)
+            if (auto msg = JournalSave(success, page)) return msg;
+        auto job = make_shared<SaveJob>();
+        job->start = wxGetLocalTimeMillis();
+        job->filename = filename;
+        job->savefilename = istempfile ? sys->TmpName(filename) : filename;
+        if (!istempfile && sys->makebaks) job->bakname = sys->BakName(filename);
+        job->istempfile = istempfile;
+        job->page = page;
+        job->success = success;
+        job->changes = changes;
+        job->undosize = undolist.size();
+        job->tags = tags;
+        job->background = background;
+        if (!istempfile) journaldirty = false;
         auto ocs = selected.GetFirst();
-        auto start_saving_time = wxGetLocalTimeMillis();
-
-        {  // limit destructors
+        job->xs = selected.xs;
+        job->ys = selected.ys;
+        job->zoomlevel = ocs ? drawpath.size() : 0;
+        if (root->grid) root->grid->MaterializeForSave();  // SerializeDB saves on other threads
+        RefreshImageRefCount(true);
+        for (auto &image : sys->imagelist) {
+            if (!image->trefc) continue;
+            job->imageindex[image.get()] = static_cast<int>(job->images.size());
+            job->images.push_back({image->type, image->display_scale, image->data});
+        }
+        if (!background) {
             wxBusyCursor wait;
-            if (!istempfile && sys->makebaks && ::wxFileExists(filename)) {
-                ::wxRenameFile(filename, sys->BakName(filename));
-            }
-            auto savefilename = istempfile ? sys->TmpName(filename) : filename;
-            wxFFileOutputStream fos(savefilename);
-            if (!fos.IsOk()) {
-                if (!istempfile)
-                    wxMessageBox(
-                        _(L"Error writing TreeSheets file! (try saving under new filename)."),
-                        savefilename.wx_str(), wxOK, sys->frame);
-                return _(L"Error writing to file.");
-            }
+            SerializeDB(*job, ocs);
+            return SaveDone(*job, WriteDB(*job));
+        }
 
-            wxDataOutputStream sos(fos);
-            fos.Write("TSFF", 4);
-            char vers = TS_VERSION;
-            fos.Write(&vers, 1);
-            sos.Write8(selected.xs);
-            sos.Write8(selected.ys);
-            sos.Write8(ocs ? drawpath.size() : 0);  // zoom level
-            RefreshImageRefCount(true);
-            int realindex = 0;
-            loopv(i, sys->imagelist) {
-                if (auto &image = *sys->imagelist[i]; image.trefc) {
-                    fos.PutC(image.type);
-                    sos.WriteDouble(image.display_scale);
-                    wxInt64 imagelen(image.data.size());
-                    sos.Write64(imagelen);
-                    fos.Write(image.data.data(), imagelen);
-                    image.savedindex = realindex++;
-                }
-            }
+        SerializeDB(*job, ocs);
+        saving = true;
+        sys->savethread = std::thread([this, job]() {
+            auto err = WriteDB(*job);
+            wxTheApp->CallAfter([this, job, err]() {
+                if (sys && sys->frame->PageOf(this) >= 0 && filename == job->filename)
+                    SaveDone(*job, err);
+            });
+        });
+        sys->frame->SetStatus(wxString::Format(_(L"Saving %s..."), filename.c_str()).c_str());
+        return _(L"");
+    }
 
-            fos.Write("D", 1);
-            wxZlibOutputStream zos(fos, 9);
-            if (!zos.IsOk()) return _(L"Zlib error while writing file.");
-            wxDataOutputStream dos(zos);
-            root->Save(dos, ocs);
-            for (auto &[tag, color] : tags) {
-                dos.WriteString(tag);
-                dos.Write32(color);
-            }
-            dos.WriteString(wxEmptyString);
+    const wxChar *SaveDone(const SaveJob &job, int err) {
+        saving = false;
+        if (err) {
+            const wxChar *msg = err == SAVE_ZLIB ? _(L"Zlib error while writing file.")
+                                                 : _(L"Error writing to file.");
+            if (!job.istempfile) JournalAll();
+            if (err == SAVE_CANTOPEN && !job.istempfile)
+                wxMessageBox(_(L"Error writing TreeSheets file! (try saving under new filename)."),
+                             job.savefilename.wx_str(), wxOK, sys->frame);
+            sys->frame->SetStatus(msg);
+            return msg;
         }
-        lastmodsinceautosave = 0;
+        auto unchanged = changes == job.changes;
+        if (unchanged) lastmodsinceautosave = 0;
         lastsave = wxGetLocalTime();
         auto end_saving_time = wxGetLocalTimeMillis();
 
-        if (!istempfile) {
-            undolistsizeatfullsave = undolist.size();
-            modified = false;
+        if (!job.istempfile) {
+            undolistsizeatfullsave = job.undosize;
+            if (unchanged) modified = false;
             tmpsavesuccess = true;
-            sys->FileUsed(filename, this);
-            if (::wxFileExists(sys->TmpName(filename))) ::wxRemoveFile(sys->TmpName(filename));
+            sys->FileUsed(job.filename, this);
+            if (::wxFileExists(sys->TmpName(job.filename)))
+                ::wxRemoveFile(sys->TmpName(job.filename));
+            if (!job.journal) {
+                JournalBase();
+                if (::wxFileExists(sys->JournalName(job.filename)))
+                    ::wxRemoveFile(sys->JournalName(job.filename));
+            }
         }
         if (sys->autohtmlexport) {
-            ExportFile(sys->ExtName(filename, L".html"),
+            ExportFile(sys->ExtName(job.filename, L".html"),
                        sys->autohtmlexport == A_AUTOEXPORT_HTML_WITH_IMAGES - A_AUTOEXPORT_HTML_NONE
                            ? A_EXPHTMLTE
                            : A_EXPHTMLT,
                        false);
         }
-        UpdateFileName(page);
-        if (success) *success = true;
+        UpdateFileName(job.background ? sys->frame->PageOf(this) : job.page);
+        if (job.success) *job.success = true;
 
         sys->frame->SetStatus(wxString::Format(_(L"Saved %s successfully (in %lld milliseconds)."),
-                                               filename.c_str(),
-                                               end_saving_time - start_saving_time)
+                                               job.filename.c_str(),
+                                               end_saving_time - job.start)
                                   .c_str());
 
         return _(L"");
     }
 
+    void JournalChange(const vector<Selection> &path) {
+        if (!journaldirty) {
+            journalpath = path;
+            journaldirty = true;
+            return;
+        }
+        // paths are stored bottom-up, keep the part shared from the root down
+        size_t common = 0;
+        for (auto a = path.rbegin(), b = journalpath.rbegin();
+             a != path.rend() && b != journalpath.rend() && a->x == b->x && a->y == b->y; a++, b++)
+            common++;
+        journalpath.erase(journalpath.begin(), journalpath.end() - common);
+    }
+
+    void JournalAll() {
+        journalpath.clear();
+        journaldirty = true;
+    }
+
+    void JournalBase() {
+        wxFileName fn(filename);
+        journalbase = filename;
+        journalbasesize = fn.FileExists() ? fn.GetSize().GetValue() : 0;
+        journalbasetime = fn.FileExists() ? fn.GetModificationTime().GetValue().GetValue() : 0;
+    }
+
+    bool JournalApplies() {
+        wxFileName fn(filename);
+        return journalbase == filename && fn.FileExists() &&
+               fn.GetSize().GetValue() == journalbasesize &&
+               fn.GetModificationTime().GetValue().GetValue() == journalbasetime;
+    }
+
+    // Appends the smallest subtree holding all changes since the last save to a journal next to
+    // the file, which LoadDB replays. Returns nullptr when a full save is needed instead, which
+    // is also how the journal gets folded back once it grows past half the size of the file.
+    const wxChar *JournalSave(bool *success, int page) {
+        if (!sys->journal || !journaldirty || journalpath.empty() || !JournalApplies())
+            return nullptr;
+        auto jn = sys->JournalName(filename);
+        auto exists = ::wxFileExists(jn);
+        if (exists) {
+            wxFFileInputStream fis(jn);
+            uchar version = 0;
+            if (!fis.IsOk() || !sys->JournalMatches(fis, filename, version) ||
+                version != TS_VERSION ||
+                uint64_t(fis.GetLength()) > max(uint64_t(1024 * 1024), journalbasesize / 2))
+                return nullptr;
+        }
+        SaveJob job;
+        job.start = wxGetLocalTimeMillis();
+        job.filename = job.savefilename = filename;
+        job.istempfile = false;
+        job.page = page;
+        job.success = success;
+        job.changes = changes;
+        job.undosize = undolist.size();
+        job.journal = true;
+
+        auto c = WalkPath(journalpath);
+        loopv(i, sys->imagelist) sys->imagelist[i]->trefc = 0;
+        c->ImageRefCount(true);
+        auto entry = System::Deflate([&](wxDataOutputStream &dos) {
+            dos.Write32(static_cast<wxUint32>(journalpath.size()));
+            loopvrev(i, journalpath) {
+                dos.Write32(journalpath[i].x);
+                dos.Write32(journalpath[i].y);
+            }
+            vector<Image *> images;
+            ImageIndex imageindex;
+            for (auto &image : sys->imagelist)
+                if (image->trefc) {
+                    imageindex[image.get()] = static_cast<int>(images.size());
+                    images.push_back(image.get());
+                }
+            dos.Write32(static_cast<wxUint32>(images.size()));
+            for (auto image : images) {
+                dos.Write8(image->type);
+                dos.WriteDouble(image->display_scale);
+                dos.Write64(wxUint64(image->data->size()));
+                dos.Write8(image->data->data(), image->data->size());
+            }
+            c->Save(dos, imageindex, nullptr);
+            for (auto &[tag, color] : tags) {
+                dos.WriteString(tag);
+                dos.Write32(color);
+            }
+            dos.WriteString(wxEmptyString);
+        });
+        if (entry.empty()) return nullptr;
+
+        wxFFileOutputStream fos(jn, L"ab");
+        if (!fos.IsOk()) return nullptr;
+        wxDataOutputStream sos(fos);
+        if (!exists) {
+            fos.Write("TSJF", 4);
+            char vers = TS_VERSION;
+            fos.Write(&vers, 1);
+            sos.Write64(journalbasesize);
+            sos.Write64(wxUint64(journalbasetime));
+        }
+        fos.PutC('E');
+        sos.Write64(wxUint64(entry.size()));
+        fos.Write(entry.data(), entry.size());
+        if (!fos.Close()) {
+            JournalAll();  // a torn entry ends the replay, so fold everything back instead
+            return nullptr;
+        }
+        journaldirty = false;
+        return SaveDone(job, SAVE_OK);
+    }
+
     void DrawSelect(wxDC &dc, Selection &s) {
         if (!s.grid) return;
         ResetFont();
@@ -290,7 +613,7 @@ struct Document {
     }
 
     void ZoomTiny() {
-        if (auto c = selected.GetCell(); c && c->tiny) {
+        if (auto c = selected.GetCell(); c && c->L().tiny) {
             Zoom(1);  // seems to leave selection box in a weird location?
             if (selected.GetCell() != c) ZoomTiny();
         }
@@ -343,11 +666,11 @@ struct Document {
             case A_DRAGANDDROP: {
                 sys->cellclipboard = c ? c->Clone(nullptr) : selected.grid->CloneSel(selected);
                 wxDataObjectComposite dragdata;
-                if (c && !c->text.t && c->text.image) {
+                if (c && !c->text.GetText() && c->text.image) {
                     auto image = c->text.image;
-                    if (!image->data.empty()) {
+                    if (!image->data->empty()) {
                         auto &[it, mime] = imagetypes.at(image->type);
-                        auto bitmap = ConvertBufferToWxBitmap(image->data, it);
+                        auto bitmap = ConvertBufferToWxBitmap(*image->data, it);
                         dragdata.Add(new wxBitmapDataObject(bitmap));
                     }
                 } else {
@@ -367,7 +690,8 @@ struct Document {
                 sys->cellclipboard = nullptr;
                 auto clipboardtextdata = new wxDataObjectComposite();
                 wxString s = "";
-                loopallcellssel(c, true) if (c->text.t.Len()) s += c->text.t + " ";
+                loopallcellssel(c, true) if (c->text.GetText().Len()) s +=
+                    wxString(c->text.GetText()) + " ";
                 if (!selected.TextEdit()) sys->clipboardcopy = s;
                 clipboardtextdata->Add(new wxTextDataObject(s));
                 if (wxTheClipboard->Open()) {
@@ -380,11 +704,11 @@ struct Document {
             case A_COPYWI:
             default: {
                 sys->cellclipboard = c ? c->Clone(nullptr) : selected.grid->CloneSel(selected);
-                if (c && !c->text.t && c->text.image) {
+                if (c && !c->text.GetText() && c->text.image) {
                     auto image = c->text.image;
-                    if (!image->data.empty() && wxTheClipboard->Open()) {
+                    if (!image->data->empty() && wxTheClipboard->Open()) {
                         auto &[it, mime] = imagetypes.at(image->type);
-                        auto bitmap = ConvertBufferToWxBitmap(image->data, it);
+                        auto bitmap = ConvertBufferToWxBitmap(*image->data, it);
                         wxTheClipboard->SetData(new wxBitmapDataObject(bitmap));
                         wxTheClipboard->Close();
                     }
@@ -449,14 +773,13 @@ struct Document {
                 if (!LastUndoSameCellAny(selected.grid->cell)) selected.grid->cell->AddUndo(this);
                 selected.grid->ResizeColWidths(dir, selected, hierarchical);
                 selected.grid->cell->ResetLayout();
-                selected.grid->cell->ResetChildren();
                 RefreshMove();
                 return dir > 0 ? _(L"Column width increased.") : _(L"Column width decreased.");
             }
             return L"nothing to resize";
         } else if (shift) {
             if (!selected.grid) return NoSel();
-            selected.grid->cell->AddUndo(this);
+            selected.grid->cell->AddUndo(this, selected);
             selected.grid->ResetChildren();
             selected.grid->RelSize(-dir, selected, pathscalebias);
             RefreshMove();
@@ -485,10 +808,16 @@ struct Document {
         PickFont(dc, 0, 0, 0);
         hierarchysize = 0;
         for (Cell *p = currentdrawroot->parent; p; p = p->parent)
-            if (p->text.t.Len()) hierarchysize += dc.GetCharHeight();
+            if (p->text.GetText().Len()) hierarchysize += dc.GetCharHeight();
         hierarchysize += fgutter;
-        layoutxs = currentdrawroot->sx + hierarchysize + fgutter;
-        layoutys = currentdrawroot->sy + hierarchysize + fgutter;
+        layoutxs = currentdrawroot->L().sx + hierarchysize + fgutter;
+        layoutys = currentdrawroot->L().sy + hierarchysize + fgutter;
+    }
+
+    // Frees the layout of every cell, the next Draw lays the document out again from scratch.
+    void DropLayout() {
+        lastdrawn = 0;
+        if (root) root->DropLayout();
     }
 
     void ShiftToCenter(wxDC &dc) {
@@ -504,9 +833,9 @@ struct Document {
         dc.SetTextForeground(*wxLIGHT_GREY);
         int i = 0;
         for (auto p = currentdrawroot->parent; p; p = p->parent)
-            if (p->text.t.Len()) {
+            if (p->text.GetText().Len()) {
                 int off = hierarchysize - dc.GetCharHeight() * ++i;
-                auto s = p->text.t;
+                wxString s = p->text.GetText();
                 if (static_cast<int>(s.Len()) > sys->defaultmaxcolwidth) {
                     // should take the width of these into account for layoutys, but really, the
                     // worst that can happen on a thin window is that its rendering gets cut off
@@ -524,6 +853,7 @@ struct Document {
         dc.Clear();
         if (!root) return;
         canvas->GetClientSize(&maxx, &maxy);
+        lastdrawn = wxGetLocalTime();
         Layout(dc);
         double xscale = maxx / static_cast<double>(layoutxs);
         double yscale = maxy / static_cast<double>(layoutys);
@@ -654,6 +984,12 @@ struct Document {
         return FontIsMini(textsize);
     }
 
+    // Identifies the font last picked, see Text::Measure.
+    FontKey CurrentFontKey() {
+        return {sys->fontgeneration, lasttextsize, laststylebits,
+                while_printing || scaledviewingmode};
+    }
+
     void ResetFont() {
         lasttextsize = INT_MAX;
         laststylebits = -1;
@@ -685,6 +1021,7 @@ struct Document {
     }
 
     void RemoveTmpFile() {
+        sys->WaitForSave();
         if (!filename.empty() && ::wxFileExists(sys->TmpName(filename)))
             ::wxRemoveFile(sys->TmpName(filename));
     }
@@ -692,6 +1029,7 @@ struct Document {
     bool CloseDocument() {
         bool keep = CheckForChanges();
         if (!keep) RemoveTmpFile();
+        sys->imagesdirty = true;
         return keep;
     }
 
@@ -783,14 +1121,14 @@ struct Document {
         return _(L"File exported successfully.");
     }
 
-    const wxChar *Save(bool saveas, bool *success = nullptr) {
-        if (!saveas && !filename.empty()) { return SaveDB(success); }
+    const wxChar *Save(bool saveas, bool *success = nullptr, bool background = false) {
+        if (!saveas && !filename.empty()) { return SaveDB(success, false, -1, background); }
         auto filename = ::wxFileSelector(_(L"Choose TreeSheets file to save:"), L"", L"", L"cts",
                                          _(L"TreeSheets Files (*.cts)|*.cts|All Files (*.*)|*.*"),
                                          wxFD_SAVE | wxFD_OVERWRITE_PROMPT | wxFD_CHANGE_DIR);
         if (filename.empty()) return _(L"Save cancelled.");  // avoid name being set to ""
         ChangeFileName(filename, true);
-        return SaveDB(success);
+        return SaveDB(success, false, -1, background);
     }
 
     void AutoSave(bool minimized, int page) {
@@ -798,7 +1136,7 @@ struct Document {
             (lastmodsinceautosave + 60 < wxGetLocalTime() || lastsave + 300 < wxGetLocalTime() ||
              minimized)) {
             tmpsavesuccess = false;
-            SaveDB(&tmpsavesuccess, true, page);
+            SaveDB(&tmpsavesuccess, true, page, true);
         }
     }
 
@@ -911,8 +1249,8 @@ struct Document {
                     return _(L"Nothing more to redo.");
                 }
 
-            case wxID_SAVE: return Save(false);
-            case wxID_SAVEAS: return Save(true);
+            case wxID_SAVE: return Save(false, nullptr, true);
+            case wxID_SAVEAS: return Save(true, nullptr, true);
             case A_SAVEALL: sys->SaveAll(); return nullptr;
 
             case A_EXPXML: return Export(L"xml", L"*.xml", _(L"Choose XML file to write"), action);
@@ -1104,10 +1442,13 @@ struct Document {
             case A_DEFBGCOL: {
                 auto oldbg = Background();
                 if (auto color = PickColor(sys->frame, oldbg); color != (uint)-1) {
-                    root->AddUndo(this);
+                    AddSparseUndo();
                     loopallcells(c) {
-                        if (c->cellcolor == oldbg && (!c->parent || c->parent->cellcolor == color))
+                        if (c->cellcolor == oldbg &&
+                            (!c->parent || c->parent->cellcolor == color)) {
+                            AddUndoCell(c);
                             c->cellcolor = color;
+                        }
                     }
                     canvas->Refresh();
                 }
@@ -1139,9 +1480,9 @@ struct Document {
             case A_CASESENSITIVESEARCH: {
                 sys->casesensitivesearch = !(sys->casesensitivesearch);
                 sys->cfg->Write(L"casesensitivesearch", sys->casesensitivesearch);
-                sys->searchstring = (sys->casesensitivesearch)
-                                        ? sys->frame->filter->GetValue()
-                                        : sys->frame->filter->GetValue().Lower();
+                sys->SetSearchString(sys->casesensitivesearch
+                                         ? sys->frame->filter->GetValue()
+                                         : sys->frame->filter->GetValue().Lower());
                 auto message = SearchNext(false, false, false);
                 canvas->Refresh();
                 return message;
@@ -1179,8 +1520,8 @@ struct Document {
                 auto lreplaces =
                     sys->casesensitivesearch ? (wxString)wxEmptyString : replaces.Lower();
                 if (action == A_REPLACEALL) {
-                    root->AddUndo(this);  // expensive?
-                    root->FindReplaceAll(replaces, lreplaces);
+                    AddSparseUndo();
+                    root->FindReplaceAll(this, replaces, lreplaces);
                     root->ResetChildren();
                     canvas->Refresh();
                 } else {
@@ -1316,7 +1657,7 @@ struct Document {
                         DelRowCol(selected.x, selected.grid->xs, selected.grid->xs, 0, selected.x,
                                   -1, -1, 0);
                 } else if (cell && selected.TextEdit()) {
-                    if (selected.cursor == cell->text.t.Len()) return nullptr;
+                    if (selected.cursor == cell->text.GetText().Len()) return nullptr;
                     cell->AddUndo(this);
                     cell->text.Delete(selected);
                     canvas->Refresh();
@@ -1329,7 +1670,7 @@ struct Document {
 
             case A_DELETE_WORD:
                 if (cell && selected.TextEdit()) {
-                    if (selected.cursor == cell->text.t.Len()) return nullptr;
+                    if (selected.cursor == cell->text.GetText().Len()) return nullptr;
                     cell->AddUndo(this);
                     cell->text.DeleteWord(selected);
                     canvas->Refresh();
@@ -1373,10 +1714,11 @@ struct Document {
                     return _(L"More than one cell must be selected.");
                 auto fc = selected.GetFirst();
                 wxString ct = "";
-                loopallcellssel(ci, true) if (ci != fc && ci->text.t.Len()) ct += " " + ci->text.t;
+                loopallcellssel(ci, true) if (ci != fc && ci->text.GetText().Len()) ct +=
+                    " " + wxString(ci->text.GetText());
                 if (!fc->HasContent() && !ct.Len()) return _(L"There is no content to collapse.");
                 fc->parent->AddUndo(this);
-                fc->text.t += ct;
+                fc->text.SetText(wxString(fc->text.GetText()) + ct);
                 loopallcellssel(ci, false) if (ci != fc) ci->Clear();
                 Selection deletesel(selected.grid,
                                     selected.x + int(selected.xs > 1),  // sidestep is possible?
@@ -1468,7 +1810,7 @@ struct Document {
                     case A_MARKVIEWV: newcelltype = CT_VIEWV; break;
                     case A_MARKCODE: newcelltype = CT_CODE; break;
                 }
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 loopallcellssel(c, false) {
                     c->celltype = (newcelltype == CT_CODE) ? sys->evaluator.InferCellType(c->text)
                                                            : newcelltype;
@@ -1527,7 +1869,7 @@ struct Document {
 
             case A_PASTESTYLE:
                 if (!sys->cellclipboard) return _(L"No style to paste.");
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 selected.grid->SetStyles(selected, sys->cellclipboard.get());
                 selected.grid->cell->ResetChildren();
                 canvas->Refresh();
@@ -1543,10 +1885,8 @@ struct Document {
                     selected.Cursor(this, action == A_PROGRESSCELL ? A_RIGHT : A_DOWN, false, false,
                                     true);
                 } else {
-                    selected.EnterEdit(
-                        this,
-                        action == A_ENTERCELL_JUMPTOEND ? static_cast<int>(cell->text.t.Len()) : 0,
-                        static_cast<int>(cell->text.t.Len()));
+                    auto len = static_cast<int>(cell->text.GetText().Len());
+                    selected.EnterEdit(this, action == A_ENTERCELL_JUMPTOEND ? len : 0, len);
                     RefreshMove();
                 }
                 return nullptr;
@@ -1564,7 +1904,7 @@ struct Document {
             }
 
             case A_IMAGER: {
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 selected.grid->ClearImages(selected);
                 selected.grid->cell->ResetChildren();
                 canvas->Refresh();
@@ -1592,7 +1932,7 @@ struct Document {
             case A_BORD3:
             case A_BORD4:
             case A_BORD5:
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 selected.grid->SetBorder(action - A_BORD0 + 1, selected);
                 selected.grid->cell->ResetChildren();
                 canvas->Refresh();
@@ -1620,18 +1960,20 @@ struct Document {
             case A_LASTTEXTCOLOR:
             case A_LASTBORDCOLOR:
             case A_LASTIMAGE:
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 loopallcellssel(c, true) switch (action) {
                     case A_RESETSIZE: c->text.relsize = 0; break;
                     case A_RESETWIDTH:
-                        for (int x = selected.x; x < selected.x + selected.xs; x++)
+                        for (int x = selected.x; x < selected.x + selected.xs; x++) {
                             selected.grid->colwidths[x] = sys->defaultmaxcolwidth;
+                            selected.grid->ResetColumn(x);
+                        }
                         selected.grid->cell->ResetLayout();
                         break;
                     case A_RESETSTYLE: c->text.stylebits = 0; break;
                     case A_RESETCOLOR:
                         if (c->IsTag(this)) {
-                            tags[c->text.t] = g_tagcolor_default;
+                            tags[c->text.GetText()] = g_tagcolor_default;
                         } else {
                             c->textcolor = g_textcolor_default;
                         }
@@ -1645,7 +1987,10 @@ struct Document {
                             c->parent->grid->bordercolor = sys->lastbordcolor;
                         break;
                     case A_LASTIMAGE:
-                        if (sys->lastimage) c->text.image = sys->lastimage;
+                        if (sys->lastimage) {
+                            c->text.image = sys->lastimage;
+                            c->StatsChanged();
+                        }
                         break;
                 }
                 selected.grid->cell->ResetChildren();
@@ -1653,7 +1998,7 @@ struct Document {
                 return nullptr;
 
             case A_MINISIZE: {
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 CollectCellsSel(false);
                 vector<Cell *> outer;
                 outer.insert(outer.end(), itercells.begin(), itercells.end());
@@ -1709,7 +2054,7 @@ struct Document {
                 if (v < 0) return nullptr;
                 for (auto image : imagestomanipulate) {
                     if (action == A_IMAGESCW) {
-                        int pw = image->pixel_width;
+                        int pw = image->pixelsize.x;
                         if (pw)
                             image->ImageRescale(static_cast<double>(v) / static_cast<double>(pw));
                     } else if (action == A_IMAGESCP) {
@@ -1718,6 +2063,7 @@ struct Document {
                         image->DisplayScale(v / 100.0);
                     }
                 }
+                if (action != A_IMAGESCF) sys->IndexImages();
                 currentdrawroot->ResetChildren();
                 currentdrawroot->ResetLayout();
                 canvas->Refresh();
@@ -1757,7 +2103,7 @@ struct Document {
                             finalfilename.wx_str(), wxOK, sys->frame);
                         return _(L"Error writing to file.");
                     }
-                    os.Write(image->data.data(), image->data.size());
+                    os.Write(image->data->data(), image->data->size());
                     i++;
                 }
                 return _(L"Image(s) have been saved to disk.");
@@ -1768,16 +2114,19 @@ struct Document {
                 loopallcellssel(c, true) {
                     auto image = c->text.image;
                     if (action == A_SAVE_AS_JPEG && image && image->type == 'I') {
-                        auto transferimage = ConvertBufferToWxImage(image->data, wxBITMAP_TYPE_PNG);
-                        image->data = ConvertWxImageToBuffer(transferimage, wxBITMAP_TYPE_JPEG);
+                        auto transferimage =
+                            ConvertBufferToWxImage(*image->data, wxBITMAP_TYPE_PNG);
                         image->type = 'J';
+                        image->SetData(ConvertWxImageToBuffer(transferimage, wxBITMAP_TYPE_JPEG));
+                        sys->IndexImages();
                         return _(L"Images in selected cells have been converted to JPEG format.");
                     }
                     if (action == A_SAVE_AS_PNG && image && image->type == 'J') {
                         auto transferimage =
-                            ConvertBufferToWxImage(image->data, wxBITMAP_TYPE_JPEG);
-                        image->data = ConvertWxImageToBuffer(transferimage, wxBITMAP_TYPE_PNG);
+                            ConvertBufferToWxImage(*image->data, wxBITMAP_TYPE_JPEG);
                         image->type = 'I';
+                        image->SetData(ConvertWxImageToBuffer(transferimage, wxBITMAP_TYPE_PNG));
+                        sys->IndexImages();
                         return _(L"Images in selected cells have been converted to PNG format.");
                     }
                 }
@@ -1821,15 +2170,15 @@ struct Document {
 
             case A_TAGADD: {
                 loopallcellssel(c, false) {
-                    if (!c->text.t.Len()) continue;
-                    tags[c->text.t] = g_tagcolor_default;
+                    if (!c->text.GetText().Len()) continue;
+                    tags[c->text.GetText()] = g_tagcolor_default;
                 }
                 canvas->Refresh();
                 return nullptr;
             }
 
             case A_TAGREMOVE: {
-                loopallcellssel(c, false) tags.erase(c->text.t);
+                loopallcellssel(c, false) tags.erase(c->text.GetText());
                 canvas->Refresh();
                 return nullptr;
             }
@@ -1898,7 +2247,7 @@ struct Document {
             case A_LINKIMG:
             case A_LINKREV:
             case A_LINKIMGREV: {
-                if ((action == A_LINK || action == A_LINKREV) && !cell->text.t.Len())
+                if ((action == A_LINK || action == A_LINKREV) && !cell->text.GetText().Len())
                     return _(L"No text in this cell.");
                 if ((action == A_LINKIMG || action == A_LINKIMGREV) && !cell->text.image)
                     return _(L"No image in this cell.");
@@ -1922,7 +2271,7 @@ struct Document {
                 if (cell->parent->grid->xs != 1 && cell->parent->grid->ys != 1)
                     return _(L"Can only move this cell from a Nx1 or 1xN grid.");
                 pp->AddUndo(this);
-                SetSelect(pp->grid->HierarchySwap(cell->text.t));
+                SetSelect(pp->grid->HierarchySwap(cell->text.GetText()));
                 pp->ResetChildren();
                 pp->ResetLayout();
                 canvas->Refresh();
@@ -1975,7 +2324,9 @@ struct Document {
                                    // within line
                         selected.cursor = 0;
                         break;
-                    case A_SEND: selected.cursorend = static_cast<int>(cell->text.t.Len()); break;
+                    case A_SEND:
+                        selected.cursorend = static_cast<int>(cell->text.GetText().Len());
+                        break;
                     case A_CHOME: selected.cursor = selected.cursorend = 0; break;
                     case A_CEND: selected.cursor = selected.cursorend = selected.MaxCursor(); break;
                     case A_HOME: cell->text.HomeEnd(selected, true); break;
@@ -1991,9 +2342,7 @@ struct Document {
     const wxChar *SearchNext(bool focusmatch, bool jump, bool reverse) {
         if (!root) return nullptr;  // fix crash when opening new doc
         if (!sys->searchstring.Len()) return _(L"No search string.");
-        bool lastsel = true;
-        Cell *next = root->FindNextSearchMatch(sys->searchstring, nullptr, selected.GetCell(),
-                                               lastsel, reverse);
+        auto next = NextSearchMatch(selected.GetCell(), reverse);
         if (!next) return _(L"No matches for search.");
         if (!jump) return nullptr;
         SetSelect(next->parent->grid->FindCell(next));
@@ -2002,9 +2351,39 @@ struct Document {
         return nullptr;
     }
 
+    // All cells that match the search in the order of CollectCells, kept until the search or the
+    // document changes. When the search narrows, only the previous matches are checked again.
+    const vector<Cell *> &SearchMatches() {
+        if (searchmatchesgen == sys->searchgen && searchmatcheschanges == changes)
+            return searchmatches;
+        if (searchmatchesgen >= sys->searchnarrowfrom && searchmatcheschanges == changes) {
+            std::erase_if(searchmatches, [](Cell *c) { return !c->text.IsInSearch(); });
+        } else {
+            searchmatches.clear();
+            loopallcells(c) if (c->text.IsInSearch()) searchmatches.push_back(c);
+        }
+        searchmatchesgen = sys->searchgen;
+        searchmatcheschanges = changes;
+        return searchmatches;
+    }
+
+    // The first match after cur, or before it when reverse, wrapping around at the ends.
+    Cell *NextSearchMatch(Cell *cur, bool reverse) {
+        auto &matches = SearchMatches();
+        if (matches.empty()) return nullptr;
+        if (!cur) return reverse ? matches.back() : matches.front();
+        auto before = [](const Cell *a, const Cell *b) { return a->Before(b); };
+        if (reverse) {
+            auto it = ranges::lower_bound(matches, cur, before);
+            return it == matches.begin() ? matches.back() : it[-1];
+        }
+        auto it = ranges::upper_bound(matches, cur, before);
+        return it == matches.end() ? matches.front() : *it;
+    }
+
     const wxChar *layrender(int ds, bool vert, bool toggle = false, bool noset = false) {
         if (selected.Thin()) return NoThin();
-        selected.grid->cell->AddUndo(this);
+        selected.grid->cell->AddUndo(this, selected);
         bool v = toggle ? !selected.GetFirst()->verticaltextandgrid : vert;
         if (ds >= 0 && selected.IsAll()) selected.grid->cell->drawstyle = ds;
         selected.grid->SetGridTextLayout(ds, v, noset, selected);
@@ -2143,42 +2522,254 @@ struct Document {
         // hacky way to detect word boundaries to stop coalescing, but works, and
         // not a big deal if selected is not actually related to this cell
         return undolist.size() && !c->grid && undolist.size() != undolistsizeatfullsave &&
+               !undolist.back()->sparse &&
                undolist.back()->sel.EqLoc(c->parent->grid->FindCell(c)) &&
-               (!c->text.t.EndsWith(" ") || c->text.t.Len() != selected.cursor);
+               (!wxString(c->text.GetText()).EndsWith(" ") ||
+                c->text.GetText().Len() != selected.cursor);
     }
 
-    void AddUndo(Cell *c, bool newgeneration = true) {
+    void Changed() {
+        WaitForFilter();
         redolist.clear();
+        changes++;
         lastmodsinceautosave = wxGetLocalTime();
         if (!modified) {
             modified = true;
             UpdateFileName();
         }
+    }
+
+    void AddUndo(Cell *c, bool newgeneration = true, const Selection *part = nullptr) {
+        Changed();
+        vector<Selection> path;
+        CreatePath(c, path);
+        JournalChange(path);
+        c->StatsChanged();
         if (LastUndoSameCellTextEdit(c)) return;
         auto ui = make_unique<UndoItem>();
-        ui->clone = c->Clone(nullptr);
-        ui->estimated_size = c->EstimatedMemoryUse();
+        if (part) {
+            ui->clone = c->ClonePart(*part);
+            ui->partial = true;
+            ui->part = Selection(nullptr, part->x, part->y, part->xs, part->ys);
+            ui->estimated_size = ui->clone->EstimatedMemoryUse();
+            ui->cloned_from = 0;  // other cells of c may change without a new item
+        } else {
+            ui->clone = c->Clone(nullptr);
+            ui->estimated_size = c->EstimatedMemoryUse();  // still cached from before the change
+            ui->cloned_from = (uintptr_t)c;
+        }
+        // for the cells of its grid, changes further down mark the grids they are in
+        if (c->grid) c->grid->statsdirty = true;
+        ui->path = std::move(path);
+        PushUndo(std::move(ui), newgeneration);
+    }
+
+    // Starts an undo item for changes to single cells that may be anywhere in the document,
+    // which is much cheaper than AddUndo(root) when only a few of them change. Each cell has to
+    // be added with AddUndoCell before it changes.
+    void AddSparseUndo(bool newgeneration = true) {
+        Changed();
+        auto ui = make_unique<UndoItem>();
+        ui->sparse = true;
+        ui->cloned_from = 0;
+        PushUndo(std::move(ui), newgeneration);
+    }
+
+    // Only for changes to the cell itself, not to its grid.
+    void AddUndoCell(Cell *c) {
+        auto &ui = undolist.back();
+        ASSERT(ui->sparse);
+        vector<Selection> path;
+        CreatePath(c, path);
+        JournalChange(path);
+        c->StatsChanged();
+        ui->estimated_size += sizeof(UndoCell) + sizeof(Cell) + c->text.EstimatedMemoryUse() +
+                              path.size() * sizeof(Selection);
+        ui->cells.push_back({std::move(path), c->CloneState()});
+    }
+
+    void PushUndo(unique_ptr<UndoItem> ui, bool newgeneration) {
         ui->sel = selected;
-        ui->cloned_from = (uintptr_t)c;
         if (undolist.size()) ui->generation = undolist.back()->generation + (newgeneration ? 1 : 0);
-        CreatePath(c, ui->path);
         if (selected.grid) CreatePath(selected.grid->cell, ui->selpath);
         undolist.push_back(std::move(ui));
-        size_t total_usage = 0;
-        size_t old_list_size = undolist.size();
-        // Cull undolist. Always at least keeps last item.
-        for (auto i = static_cast<int>(undolist.size()) - 1; i >= 0; i--) {
-            // Cull old items if using more than 100MB or 1000 items, whichever comes first.
-            // TODO: make configurable?
-            if (total_usage < 100 * 1024 * 1024 && undolist.size() - i < 1000) {
-                total_usage += undolist[i]->estimated_size;
-            } else {
-                undolist.erase(undolist.begin(), undolist.begin() + i + 1);
-                break;
+        TrimUndo(0);
+    }
+
+    // Keeps the newest undo items as they are. Once those use more than half of
+    // sys->undomemorymb, older ones are compressed, and once all of them use more than that, the
+    // oldest are moved to a temporary file. What does not fit in sys->undodiskmb or
+    // sys->undosteps is dropped. Always keeps the last item as it is.
+    // Compressing or spilling an item takes a while, so edits leave that to TSFrame::OnIdle
+    // (`work` is how many items it may do per call) and undotrimpending tells it there is some.
+    // Until then the items may use up to twice sys->undomemorymb.
+    void TrimUndo(int work) {
+        auto memory = size_t(sys->undomemorymb) << 20;
+        auto disk = size_t(sys->undodiskmb) << 20;
+        size_t inmemory = 0, ondisk = 0;
+        auto keep = undolist.size();
+        undotrimpending = false;
+        for (auto i = keep; i-- > 0;) {
+            auto &ui = *undolist[i];
+            if (i + 1 < undolist.size()) {
+                if (undolist.size() - i > size_t(sys->undosteps)) break;
+                if (ui.tier == UNDO_LIVE && inmemory + ui.estimated_size > memory / 2) {
+                    if (work) {
+                        work--;
+                        PackUndo(ui);
+                    } else {
+                        undotrimpending = true;
+                    }
+                }
+                if (ui.tier != UNDO_SPILLED && inmemory + UndoSize(ui) > memory) {
+                    // a live item can still be packed and a packed one spilled
+                    auto later = ui.tier == UNDO_LIVE || disk;
+                    if (ui.tier == UNDO_PACKED && disk && work) {
+                        work--;
+                        if (!SpillUndo(ui)) break;
+                    } else if (!later || inmemory + UndoSize(ui) > 2 * memory) {
+                        break;
+                    } else {
+                        undotrimpending = true;
+                    }
+                }
+                if (ui.tier == UNDO_SPILLED && ondisk + ui.spillsize > disk) break;
             }
+            if (ui.tier == UNDO_SPILLED)
+                ondisk += ui.spillsize;
+            else
+                inmemory += UndoSize(ui);
+            keep = i;
+        }
+        if (keep) {
+            undolist.erase(undolist.begin(), undolist.begin() + keep);
+            sys->imagesdirty = true;
+            undolistsizeatfullsave -= keep;  // Allowed to go < 0
         }
-        size_t items_culled = old_list_size - undolist.size();
-        undolistsizeatfullsave -= items_culled;  // Allowed to go < 0
+        if (!ondisk) CloseUndoFile();
+    }
+
+    static size_t UndoSize(const UndoItem &ui) {
+        return ui.tier == UNDO_LIVE ? ui.estimated_size : ui.packed.size();
+    }
+
+    void PackUndo(UndoItem &ui) {
+        for (auto &image : sys->imagelist) image->trefc = 0;
+        ui.MarkImages();
+        vector<Image *> images;
+        ImageIndex imageindex;
+        for (auto &image : sys->imagelist)
+            if (image->trefc) {
+                imageindex[image.get()] = static_cast<int>(images.size());
+                images.push_back(image.get());
+            }
+        auto packed = System::Deflate(
+            [&](wxDataOutputStream &dos) {
+                if (ui.sparse) {
+                    dos.Write32(static_cast<wxUint32>(ui.cells.size()));
+                    for (auto &uc : ui.cells) {
+                        dos.Write32(static_cast<wxUint32>(uc.path.size()));
+                        for (auto &s : uc.path) {
+                            dos.Write32(s.x);
+                            dos.Write32(s.y);
+                        }
+                        uc.before->Save(dos, imageindex, nullptr);
+                    }
+                } else if (ui.partial) {
+                    ui.clone->Save(dos, imageindex, nullptr, false);
+                    auto &s = ui.part;
+                    for (auto y = s.y; y < s.y + s.ys; y++)
+                        for (auto x = s.x; x < s.x + s.xs; x++)
+                            ui.clone->grid->C(x, y)->Save(dos, imageindex, nullptr);
+                } else {
+                    ui.clone->Save(dos, imageindex, nullptr);
+                }
+            },
+            1);
+        if (packed.empty()) return;  // keep it as it is
+        ui.clone.reset();
+        ui.cells.clear();
+        ui.packed = std::move(packed);
+        ui.images = std::move(images);
+        ui.tier = UNDO_PACKED;
+    }
+
+    bool SpillUndo(UndoItem &ui) {
+        if (!undofile.IsOpened()) {
+            undofilename = wxFileName::CreateTempFileName(L"tsundo");
+            if (undofilename.empty() || !undofile.Open(undofilename, wxFile::read_write))
+                return false;
+        }
+        auto offset = undofile.SeekEnd();
+        if (offset == wxInvalidOffset ||
+            undofile.Write(ui.packed.data(), ui.packed.size()) != ui.packed.size())
+            return false;
+        ui.spilloffset = offset;
+        ui.spillsize = ui.packed.size();
+        vector<uint8_t>().swap(ui.packed);
+        ui.tier = UNDO_SPILLED;
+        return true;
+    }
+
+    void CloseUndoFile() {
+        if (!undofile.IsOpened()) return;
+        undofile.Close();
+        ::wxRemoveFile(undofilename);
+    }
+
+    // Brings a packed or spilled item back, false if it can't be read anymore.
+    bool UnpackUndo(UndoItem &ui) {
+        if (ui.tier == UNDO_LIVE) return true;
+        if (ui.tier == UNDO_SPILLED) {
+            ui.packed.resize(ui.spillsize);
+            if (undofile.Seek(ui.spilloffset) == wxInvalidOffset ||
+                undofile.Read(ui.packed.data(), ui.spillsize) != ui.spillsize)
+                return false;
+        }
+        LoadContext lc {TS_VERSION, make_shared<const vector<Image *>>(ui.images)};
+        wxMemoryInputStream mis(ui.packed.data(), ui.packed.size());
+        wxZlibInputStream zis(mis);
+        wxDataInputStream dis(zis);
+        auto numcells = 0, textbytes = 0;
+        Cell *ics = nullptr;
+        auto ok = zis.IsOk();
+        auto load = [&](Cell *parent, bool withcells) {
+            if (!ok) return (Cell *)nullptr;
+            auto c = Cell::LoadWhich(dis, lc, parent, numcells, textbytes, ics, withcells);
+            ok = c != nullptr;
+            return c;
+        };
+        if (ui.sparse) {
+            for (auto n = ok ? dis.Read32() : 0; n && ok; n--) {
+                UndoCell uc;
+                uc.path.resize(dis.Read32());
+                for (auto &s : uc.path) {
+                    s.x = dis.Read32();
+                    s.y = dis.Read32();
+                }
+                uc.before.reset(load(nullptr, true));
+                ui.cells.push_back(std::move(uc));
+            }
+        } else if (ui.partial) {
+            ui.clone.reset(load(nullptr, false));
+            if (ok) {
+                auto &s = ui.part;
+                for (auto y = s.y; y < s.y + s.ys; y++)
+                    for (auto x = s.x; x < s.x + s.xs; x++)
+                        ui.clone->grid->C(x, y) = load(ui.clone.get(), true);
+                ui.clone->grid->IndexCells();
+            }
+        } else {
+            ui.clone.reset(load(nullptr, true));
+        }
+        if (!ok) return false;
+        vector<uint8_t>().swap(ui.packed);
+        ui.images.clear();
+        ui.tier = UNDO_LIVE;
+        if (std::none_of(undolist.begin(), undolist.end(),
+                         [](auto &u) { return u->tier == UNDO_SPILLED; }))
+            CloseUndoFile();
+        return true;
     }
 
     void Undo(auto &fromlist, auto &tolist, bool redo = false) {
@@ -2197,20 +2788,44 @@ struct Document {
     }
 
     void UndoEach(auto &fromlist, auto &tolist, bool redo = false) {
+        WaitForFilter();
+        if (!UnpackUndo(*fromlist.back())) {
+            fromlist.clear();  // the rest of the history depends on this item
+            sys->frame->SetStatus(_(L"The older undo history could not be read back."));
+            return;
+        }
         auto beforesel = selected;
         vector<Selection> beforepath;
         if (beforesel.grid) CreatePath(beforesel.grid->cell, beforepath);
         auto ui = std::move(fromlist.back());
         fromlist.pop_back();
-        auto c = WalkPath(ui->path);
-        auto clone = ui->clone.release();
-        ui->clone.reset(c);
-        if (c->parent && c->parent->grid) {
-            c->parent->grid->ReplaceCell(c, clone);
-            clone->parent = c->parent;
-        } else
-            root = clone;
-        clone->ResetLayout();
+        if (ui->sparse) {
+            for (auto &uc : ui->cells) {
+                JournalChange(uc.path);
+                auto c = WalkPath(uc.path);
+                c->SwapState(uc.before.get());
+                c->StatsChanged();
+                c->ResetLayout();  // only the cell's own state changed, not its children
+            }
+        } else {
+            JournalChange(ui->path);
+            auto c = WalkPath(ui->path);
+            c->StatsChanged();
+            if (ui->partial) {
+                c->SwapPart(ui->clone.get(), ui->part);
+                c->ResetChildren();
+                c->ResetLayout();
+            } else {
+                auto clone = ui->clone.release();
+                ui->clone.reset(c);
+                if (c->parent && c->parent->grid) {
+                    c->parent->grid->ReplaceCell(c, clone);
+                    clone->parent = c->parent;
+                } else
+                    root = clone;
+                clone->ResetLayout();
+            }
+        }
         SetSelect(ui->sel);
         if (selected.grid) selected.grid = WalkPath(ui->selpath)->grid;
         begindrag = selected;
@@ -2220,6 +2835,7 @@ struct Document {
         if (undolistsizeatfullsave > undolist.size())
             undolistsizeatfullsave = -1;  // gone beyond the save point, always modified
         modified = undolistsizeatfullsave != undolist.size();
+        changes++;
     }
 
     void ColorChange(int which, int idx) {
@@ -2236,6 +2852,7 @@ struct Document {
     void SetImageBM(Cell *c, auto &&data, double scale) {
         c->text.image = sys->lastimage =
             sys->imagelist[sys->AddImageToList(scale, std::move(data), 'I')].get();
+        c->StatsChanged();
     }
 
     bool LoadImageIntoCell(const wxString &filename, Cell *c, double scale) {
@@ -2250,7 +2867,7 @@ struct Document {
 
     void ImageChange(wxString &filename, double scale) {
         if (!selected.grid) return;
-        selected.grid->cell->AddUndo(this);
+        selected.grid->cell->AddUndo(this, selected);
         loopallcellssel(c, false) LoadImageIntoCell(filename, c, scale);
         canvas->Refresh();
     }
@@ -2267,7 +2884,7 @@ struct Document {
         int i = 0;
         for (auto &[tag, color] : tags)
             if (i++ == tagno) {
-                selected.grid->cell->AddUndo(this);
+                selected.grid->cell->AddUndo(this, selected);
                 loopallcellssel(c, false) {
                     c->text.Clear(this, selected);
                     c->text.Insert(this, tag, selected, true);
@@ -2292,6 +2909,7 @@ struct Document {
     }
 
     void ApplyEditFilter() {
+        CancelFilter();
         searchfilter = false;
         paintscrolltoselection = true;
         editfilter = min(max(editfilter, 1), 99);
@@ -2306,6 +2924,7 @@ struct Document {
     }
 
     void ApplyEditRangeFilter(wxDateTime &rangebegin, wxDateTime &rangeend) {
+        CancelFilter();
         searchfilter = false;
         paintscrolltoselection = true;
         CollectCells(root);
@@ -2323,14 +2942,71 @@ struct Document {
         return dt;
     }
 
+    // Matches the cells on the workers, in chunks, so typing in the search box does not wait
+    // for it. The cells are only laid out again once a pass is done, and a newer pass stops an
+    // older one that is still running.
     void SetSearchFilter(bool on) {
         searchfilter = on;
         paintscrolltoselection = true;
-        loopallcells(c) c->text.filtered = on && !c->text.IsInSearch();
+        CancelFilter();
+        std::erase_if(filtering, [](auto &f) {
+            return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        if (!on) {
+            loopallcells(c) c->text.filtered = false;
+            root->ResetChildren();
+            canvas->Refresh();
+            return;
+        }
+        CollectCells(root);  // loads folded cells here, the workers can't
+        auto pass = make_shared<FilterPass>();
+        pass->generation = filtergeneration;
+        pass->search = sys->searchutf8;
+        pass->casesensitive = sys->casesensitivesearch;
+        pass->cells = itercells;
+        pass->filtered.resize(itercells.size());
+        auto &workers = sys->Workers();
+        auto threads = max(1u, std::thread::hardware_concurrency());
+        auto chunk = max(itercells.size() / (4 * threads), size_t(1024));
+        pass->chunksleft = (itercells.size() + chunk - 1) / chunk;
+        filterpass = pass;
+        for (size_t start = 0; start < itercells.size(); start += chunk) {
+            auto end = min(start + chunk, itercells.size());
+            filtering.push_back(workers.enqueue([this, pass, start, end]() {
+                for (auto i = start; i < end; i++) {
+                    if (!(i % 256) && filtergeneration != pass->generation) return;
+                    pass->filtered[i] = pass->search.empty() ||
+                                        !pass->cells[i]->text.Matches(pass->search,
+                                                                      pass->casesensitive);
+                }
+                if (--pass->chunksleft) return;
+                wxTheApp->CallAfter([this, pass]() {
+                    if (sys && sys->frame->PageOf(this) >= 0) ApplyFilter(pass);
+                });
+            }));
+        }
+    }
+
+    void ApplyFilter(const shared_ptr<FilterPass> &pass) {
+        if (pass != filterpass) return;  // cancelled, or applied already
+        filterpass.reset();
+        loopv(i, pass->cells) pass->cells[i]->text.filtered = pass->filtered[i] != 0;
         root->ResetChildren();
         canvas->Refresh();
     }
 
+    void CancelFilter() {
+        filtergeneration++;
+        filterpass.reset();
+    }
+
+    // Edits change the cells the workers read, so they apply a running pass first.
+    void WaitForFilter() {
+        for (auto &f : filtering) f.wait();
+        filtering.clear();
+        if (filterpass) ApplyFilter(filterpass);
+    }
+
     void ExportAllImages(const wxString &filename, Cell *exportroot) {
         std::set<Image *> exportimages;
         CollectCells(exportroot);
@@ -75,7 +75,7 @@ struct Evaluator {
     }
 
     int InferCellType(Text &t) {
-        if (ops[t.t])
+        if (ops[t.GetText()])
             return CT_CODE;
         else
             return CT_DATA;
@@ -95,7 +95,7 @@ struct Evaluator {
     }
 
     void Assign(const Cell *sym, const Cell *val) {
-        this->SetSymbol(sym->text.t, val->Clone(nullptr));
+        this->SetSymbol(sym->text.GetText(), val->Clone(nullptr));
         if (sym->grid && val->grid) this->DestructuringAssign(sym->grid, val->Clone(nullptr));
     }
 
@@ -106,12 +106,12 @@ struct Evaluator {
             loop(x, ng->xs) loop(y, ng->ys) {
                 Cell *nc = ng->C(x, y);
                 Cell *vc = vg->C(x, y);
-                this->SetSymbol(nc->text.t, vc->Clone(nullptr));
+                this->SetSymbol(nc->text.GetText(), vc->Clone(nullptr));
             }
         }
     }
 
-    Operation *FindOp(wxString &name) { return ops[name]; }
+    Operation *FindOp(const wxString &name) { return ops[name]; }
 
     unique_ptr<Cell> Execute(const Operation *op) { return op->run(); }
 
@@ -120,7 +120,7 @@ struct Evaluator {
         Grid *g = left->grid;
         switch (op->args[0]) {
             case 'n':
-                if (t.t.Len()) {
+                if (t.GetText().Len()) {
                     t.SetNum(op->runn(t.GetNum()));
                     return left;
                 } else if (g) {
@@ -129,7 +129,7 @@ struct Evaluator {
                 }
                 break;
             case 't':
-                if (t.t.Len()) {
+                if (t.GetText().Len()) {
                     return op->runc(std::move(left));
                 } else if (g) {
                     foreachcellingrid(c, g) c =
@@ -170,7 +170,7 @@ struct Evaluator {
         Grid *g2 = right->grid;
         switch (op->args[0]) {
             case 'n':
-                if (t1.t.Len() && t2.t.Len()) {
+                if (t1.GetText().Len() && t2.GetText().Len()) {
                     t1.SetNum(op->runnn(t1.GetNum(), t2.GetNum()));
                 } else if (g1 && g2 && g1->xs == g2->xs && g1->ys == g2->ys) {
                     Grid *g = new Grid(g1->xs, g1->ys);
@@ -183,7 +183,7 @@ struct Evaluator {
                         c1 = nullptr;
                     }
                     return c;
-                } else if (g1 && t2.t.Len()) {
+                } else if (g1 && t2.GetText().Len()) {
                     foreachcellingrid(c, g1) {
                         c = Execute(op, unique_ptr<Cell>(c), right.get())
                                 .release()
@@ -199,7 +199,7 @@ struct Evaluator {
     unique_ptr<Cell> Execute(const Operation *op, unique_ptr<Cell> left, const Cell *a,
                              const Cell *b) {
         Text &l = left->text;
-        if (!l.t.Len()) return left;
+        if (!l.GetText().Len()) return left;
         bool cond = l.GetNum() != 0;
         return (cond ? a : b)->Eval(*this);
     }
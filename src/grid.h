@@ -1,13 +1,29 @@
-struct Grid {
+// The saved cells of a folded grid, kept as they were in the file until they are first needed.
+struct UnloadedCells {
+    vector<uint8_t> data;
+    CellStats stats;  // of the cells in data, without bytes
+    LoadContext context;  // of the load they came from
+    bool hasimages;
+    int minrelsize;
+};
+
+struct Grid : Pooled<Grid> {
     // owning cell.
     Cell *cell;
-    // subcells
+    // subcells, row by row, with room for capx columns per row and capy rows, see Reserve
     Cell **cells;
     // widths for each column
     vector<int> colwidths;
+    // offsets and sizes of columns and rows from the last Layout, ascending
+    vector<int> colpos;
+    vector<int> colsize;
+    vector<int> rowpos;
+    vector<int> rowsize;
     // xsize, ysize
     int xs;
     int ys;
+    int capx;
+    int capy;
     int view_margin;
     int view_grid_outer_spacing;
     int user_grid_outer_spacing {g_usergridouterspacing_default};
@@ -16,10 +32,55 @@ struct Grid {
     bool horiz {false};
     bool tinyborder;
     bool folded {false};
+    // cells changed since the last Layout, with their size before, see MarkDirty
+    struct DirtyCell {
+        Cell *c;
+        int x, y, minx, miny;
+    };
+    vector<DirtyCell> dirtycells;
+    bool alldirty {false};
+    // smallest relsize in the subtree, recomputed by MinRelsize after a reset below it
+    int minrelsize {INT_MAX};
+    bool relsizedirty {true};
+    // totals of the cells below, valid unless statsdirty, see Cell::StatsChanged
+    mutable CellStats stats;
+    mutable bool statsdirty {true};
+    // set while the cells are still unloaded, any access through C() loads them
+    mutable shared_ptr<const UnloadedCells> unloaded;
 
     Cell *&C(int x, int y) const {
         ASSERT(x >= 0 && y >= 0 && x < xs && y < ys);
-        return cells[x + y * xs];
+        if (unloaded) Materialize();
+        return cells[x + y * capx];
+    }
+
+    // Fills in the cells behind a const Grid, which only the UI thread may do as it owns the
+    // document. Saves get MaterializeForSave done before they leave it.
+    void Materialize() const {
+        ASSERT(wxIsMainThread());
+        auto u = std::move(unloaded);
+        wxMemoryInputStream mis(u->data.data(), u->data.size());
+        wxDataInputStream dis(mis);
+        auto numcells = 0, textbytes = 0;
+        Cell *ics = nullptr;
+        auto ok = true;
+        loop(i, xs * ys) {
+            auto c = ok ? Cell::LoadWhich(dis, u->context, cell, numcells, textbytes, ics)
+                        : nullptr;
+            if (!c) {  // a corrupted block leaves the rest empty rather than failing the load
+                ok = false;
+                c = new Cell(cell);
+            }
+            c->gridx = i % xs;
+            c->gridy = i / xs;
+            cells[c->gridx + c->gridy * capx] = c;
+        }
+        StatsChanged();  // they take more memory loaded
+    }
+
+    // Unloaded cells without images are saved by copying them, others are loaded first.
+    bool CanCopyUnloaded() const {
+        return unloaded && !unloaded->hasimages && unloaded->context.version == TS_VERSION;
     }
 
     #define foreachcell(c)                \
@@ -58,14 +119,14 @@ struct Grid {
                     for (Cell *&c = g->C(x, y); _f; _f = false)
 
     Grid(int _xs, int _ys, Cell *_c = nullptr)
-        : xs(_xs), ys(_ys), cell(_c), cells(new Cell *[_xs * _ys]) {
+        : xs(_xs), ys(_ys), capx(_xs), capy(_ys), cell(_c), cells(new Cell *[_xs * _ys]) {
         foreachcell(c) c = nullptr;
         InitColWidths();
         SetOrient();
     }
 
     ~Grid() {
-        foreachcell(c) if (c) delete c;
+        if (!unloaded) foreachcell(c) if (c) delete c;
         delete[] cells;
     }
 
@@ -87,21 +148,74 @@ struct Grid {
         g->bordercolor = bordercolor;
         g->user_grid_outer_spacing = user_grid_outer_spacing;
         g->folded = folded;
-        foreachcell(c) g->C(x, y) = c->Clone(g->cell).release();
+        if (unloaded)
+            g->unloaded = unloaded;
+        else
+            foreachcell(c) g->C(x, y) = c->Clone(g->cell).release();
         loop(x, xs) g->colwidths[x] = colwidths[x];
+        g->IndexCells();
+    }
+
+    // Like Clone, but only with the cells in sel, the others are left empty.
+    void ClonePart(Grid *g, const Selection &sel) {
+        g->bordercolor = bordercolor;
+        g->user_grid_outer_spacing = user_grid_outer_spacing;
+        g->folded = folded;
+        g->colwidths = colwidths;
+        foreachcellinsel(c, sel) g->C(x, y) = c->Clone(g->cell).release();
+        g->IndexCells();
+    }
+
+    // Exchanges what ClonePart copied with g, which makes undo and redo the same operation.
+    void SwapPart(Grid *g, const Selection &sel) {
+        swap_(bordercolor, g->bordercolor);
+        swap_(user_grid_outer_spacing, g->user_grid_outer_spacing);
+        swap_(folded, g->folded);
+        colwidths.swap(g->colwidths);
+        foreachcellinsel(c, sel) {
+            std::swap(c, g->C(x, y));
+            c->parent = cell;
+            g->C(x, y)->parent = g->cell;
+        }
+        IndexCells();
+        g->IndexCells();
+        StatsChanged();
+        g->StatsChanged();
     }
 
     unique_ptr<Cell> CloneSel(const Selection &sel) {
         auto cl = make_unique<Cell>(nullptr, sel.grid->cell, CT_DATA, new Grid(sel.xs, sel.ys));
         foreachcellinsel(c, sel) cl->grid->C(x - sel.x, y - sel.y) = c->Clone(cl.get()).release();
         loop(i, sel.xs) cl->grid->colwidths[i] = sel.grid->colwidths[i];
+        cl->grid->IndexCells();
         return cl;
     }
 
-    size_t EstimatedMemoryUse() {
-        size_t sum = 0;
-        foreachcell(c) sum += c->EstimatedMemoryUse();
-        return sizeof(Grid) + xs * ys * sizeof(Cell *) + sum;
+    const CellStats &Stats() const {
+        if (!statsdirty) return stats;
+        stats = CellStats();
+        if (unloaded) {
+            stats = unloaded->stats;
+            stats.bytes = unloaded->data.size();
+        } else {
+            foreachcell(c) if (c) stats += c->Stats();
+        }
+        stats.bytes += sizeof(Grid) + capx * capy * sizeof(Cell *);
+        statsdirty = false;
+        return stats;
+    }
+
+    CellStats Stats(const Selection &sel) const {
+        CellStats st;
+        foreachcellinsel(c, sel) st += c->Stats();
+        return st;
+    }
+
+    // For changes to which cells this grid holds, changes to the cells themselves mark it
+    // through Cell::StatsChanged.
+    void StatsChanged() const {
+        statsdirty = true;
+        if (cell) cell->StatsChanged();
     }
 
     void SetOrient() {
@@ -111,16 +225,21 @@ struct Grid {
 
     bool Layout(Document *doc, wxDC &dc, int depth, int &sx, int &sy, int startx, int starty,
                 bool forcetiny) {
-        auto xa = new int[xs];
-        auto ya = new int[ys];
-        loop(i, xs) xa[i] = 0;
-        loop(i, ys) ya[i] = 0;
+        auto &xa = colsize;
+        auto &ya = rowsize;
+        dirtycells.clear();
+        alldirty = false;
+        xa.assign(xs, 0);
+        ya.assign(ys, 0);
+        colpos.resize(xs);
+        rowpos.resize(ys);
         tinyborder = true;
         foreachcell(c) {
             c->LazyLayout(doc, dc, depth + 1, colwidths[x], forcetiny);
-            tinyborder = c->tiny && tinyborder;
-            xa[x] = max(xa[x], c->sx);
-            ya[y] = max(ya[y], c->sy);
+            auto &l = c->L();
+            tinyborder = l.tiny && tinyborder;
+            xa[x] = max(xa[x], l.sx);
+            ya[y] = max(ya[y], l.sy);
         }
         view_grid_outer_spacing =
             tinyborder || cell->drawstyle != DS_GRID ? 0 : user_grid_outer_spacing;
@@ -134,50 +253,88 @@ struct Grid {
         loop(i, ys) sy += ya[i];
         int cx = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + startx;
         int cy = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + starty;
-        if (!cell->tiny) {
+        if (!cell->L().tiny) {
             cx += g_margin_extra;
             cy += g_margin_extra;
         }
         foreachcell(c) {
-            c->ox = cx;
-            c->oy = cy;
+            auto &l = c->L();
+            l.ox = colpos[x] = cx;
+            l.oy = rowpos[y] = cy;
             if (c->drawstyle == DS_BLOBLINE && !c->grid) {
-                assert(c->sy <= ya[y]);
-                c->ycenteroff = (ya[y] - c->sy) / 2;
+                assert(l.sy <= ya[y]);
+                l.ycenteroff = (ya[y] - l.sy) / 2;
             }
-            c->sx = xa[x];
-            c->sy = ya[y];
+            l.sx = xa[x];
+            l.sy = ya[y];
             cx += xa[x] + g_line_width + cell_margin * 2;
             if (x == xs - 1) {
                 cy += ya[y] + g_line_width + cell_margin * 2;
                 cx = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + startx;
-                if (!cell->tiny) cx += g_margin_extra;
+                if (!cell->L().tiny) cx += g_margin_extra;
             }
         }
-        delete[] xa;
-        delete[] ya;
         return tinyborder;
     }
 
+    void MarkDirty(Cell *c) {
+        cell->childdirty = true;
+        relsizedirty = true;
+        if (alldirty) return;
+        for (auto &d : dirtycells)
+            if (d.c == c) return;
+        if (dirtycells.size() >= 64 || !Locate(c)) {
+            dirtycells.clear();
+            alldirty = true;
+        } else
+            dirtycells.push_back({c, c->gridx, c->gridy, c->L().minx, c->L().miny});
+    }
+
+    // Lays out only the cells from MarkDirty. Fails when that would change the size of a column
+    // or row, and Layout has to reposition everything.
+    bool UpdateLayout(Document *doc, wxDC &dc, int depth, bool forcetiny) {
+        if (alldirty || !IsLaidOut()) return false;
+        auto dirty = std::move(dirtycells);
+        dirtycells.clear();
+        for (auto &d : dirty) {
+            if (d.x >= xs || d.y >= ys || C(d.x, d.y) != d.c) return false;
+            auto c = d.c;
+            auto &l = c->L();
+            auto wastiny = l.tiny;
+            c->LazyLayout(doc, dc, depth + 1, colwidths[d.x], forcetiny);
+            if (l.tiny != wastiny || l.sx > colsize[d.x] || l.sy > rowsize[d.y] ||
+                l.sx != d.minx && (!d.minx || d.minx == colsize[d.x]) ||
+                l.sy != d.miny && (!d.miny || d.miny == rowsize[d.y]))
+                return false;
+            if (c->drawstyle == DS_BLOBLINE && !c->grid) l.ycenteroff = (rowsize[d.y] - l.sy) / 2;
+            l.ox = colpos[d.x];
+            l.oy = rowpos[d.y];
+            l.sx = colsize[d.x];
+            l.sy = rowsize[d.y];
+        }
+        return true;
+    }
+
     void Render(Document *doc, int bx, int by, wxDC &dc, int depth, int sx, int sy, int xoff,
                 int yoff) {
-        xoff = C(0, 0)->ox - view_margin - view_grid_outer_spacing - 1;
-        yoff = C(0, 0)->oy - view_margin - view_grid_outer_spacing - 1;
-        int maxx = C(xs - 1, 0)->ox + C(xs - 1, 0)->sx;
-        int maxy = C(0, ys - 1)->oy + C(0, ys - 1)->sy;
+        xoff = C(0, 0)->L().ox - view_margin - view_grid_outer_spacing - 1;
+        yoff = C(0, 0)->L().oy - view_margin - view_grid_outer_spacing - 1;
+        int maxx = C(xs - 1, 0)->L().ox + C(xs - 1, 0)->L().sx;
+        int maxy = C(0, ys - 1)->L().oy + C(0, ys - 1)->L().sy;
+        auto vis = VisibleCells(doc, bx, by);
         if (tinyborder || cell->drawstyle == DS_GRID) {
             int ldelta = view_grid_outer_spacing != 0;
             auto drawlines = [&]() {
-                for (int x = ldelta; x <= xs - ldelta; x++) {
-                    int xl = (x == xs ? maxx : C(x, 0)->ox - g_line_width) + bx;
+                for (int x = max(ldelta, vis.x); x <= min(xs - ldelta, vis.x + vis.xs); x++) {
+                    int xl = (x == xs ? maxx : C(x, 0)->L().ox - g_line_width) + bx;
                     if (xl >= doc->scrollx && xl <= doc->maxx) loop(line, g_line_width) {
                             dc.DrawLine(
                                 xl + line, max(doc->scrolly, by + yoff + view_grid_outer_spacing),
                                 xl + line, min(doc->maxy, by + maxy + g_line_width) + view_margin);
                         }
                 }
-                for (int y = ldelta; y <= ys - ldelta; y++) {
-                    int yl = (y == ys ? maxy : C(0, y)->oy - g_line_width) + by;
+                for (int y = max(ldelta, vis.y); y <= min(ys - ldelta, vis.y + vis.ys); y++) {
+                    int yl = (y == ys ? maxy : C(0, y)->L().oy - g_line_width) + by;
                     if (yl >= doc->scrolly && yl <= doc->maxy) loop(line, g_line_width) {
                             dc.DrawLine(max(doc->scrollx,
                                             bx + xoff + view_grid_outer_spacing + g_line_width),
@@ -196,28 +353,31 @@ struct Grid {
             drawlines();
         }
 
-        foreachcell(c) {
-            int cx = bx + c->ox;
-            int cy = by + c->oy;
-            if (cx < doc->maxx && cx + c->sx > doc->scrollx && cy < doc->maxy &&
-                cy + c->sy > doc->scrolly) {
+        foreachcellinsel(c, vis) {
+            auto &l = c->L();
+            int cx = bx + l.ox;
+            int cy = by + l.oy;
+            if (cx < doc->maxx && cx + l.sx > doc->scrollx && cy < doc->maxy &&
+                cy + l.sy > doc->scrolly) {
                 c->Render(doc, cx, cy, dc, depth + 1, (x == 0) * view_margin,
                           (x == xs - 1) * view_margin, (y == 0) * view_margin,
                           (y == ys - 1) * view_margin, colwidths[x], cell_margin);
             }
         }
 
-        if (cell->drawstyle == DS_BLOBLINE && !tinyborder && cell->HasHeader() && !cell->tiny) {
+        auto &cl = cell->L();
+        if (cell->drawstyle == DS_BLOBLINE && !tinyborder && cell->HasHeader() && !cl.tiny) {
             const int arcsize = 8;
-            int srcy = by + cell->ycenteroff +
-                       (cell->verticaltextandgrid ? cell->tys + 2 : cell->tys / 2) + g_margin_extra;
+            int srcy = by + cl.ycenteroff +
+                       (cell->verticaltextandgrid ? cl.tys + 2 : cl.tys / 2) + g_margin_extra;
             // fixme: the 8 is chosen to fit the smallest text size, not very portable
-            int srcx = bx + (cell->verticaltextandgrid ? 8 : cell->txs + 4) + g_margin_extra;
+            int srcx = bx + (cell->verticaltextandgrid ? 8 : cl.txs + 4) + g_margin_extra;
             int destyfirst = -1, destylast = -1;
             dc.SetPen(*wxGREY_PEN);
-            foreachcelly(c) if (c->HasContent() && !c->tiny) {
-                int desty = c->ycenteroff + by + c->oy + c->tys / 2 + g_margin_extra;
-                int destx = bx + c->ox - 2 + g_margin_extra;
+            foreachcelly(c) if (c->HasContent() && !c->L().tiny) {
+                auto &l = c->L();
+                int desty = l.ycenteroff + by + l.oy + l.tys / 2 + g_margin_extra;
+                int destx = bx + l.ox - 2 + g_margin_extra;
                 bool visible = srcx < doc->maxx && destx > doc->scrollx &&
                                desty - arcsize < doc->maxy && desty + arcsize > doc->scrolly;
                 if (abs(srcy - desty) < arcsize && !cell->verticaltextandgrid) {
@@ -262,25 +422,62 @@ struct Grid {
         }
     }
 
+    bool IsLaidOut() const { return colpos.size() == xs && rowpos.size() == ys; }
+
+    // first i in [lo, hi) for which pred holds, given pred is false then true over that range
+    static int FirstWhere(int lo, int hi, auto pred) {
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (pred(mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    // The cells overlapping the visible part of the canvas form a rectangle, which a binary
+    // search on the column and row offsets finds.
+    Selection VisibleCells(Document *doc, int bx, int by) {
+        if (!IsLaidOut()) return SelectAll();
+        int x0 =
+            FirstWhere(0, xs, [&](int x) { return bx + colpos[x] + colsize[x] > doc->scrollx; });
+        int x1 = FirstWhere(x0, xs, [&](int x) { return bx + colpos[x] >= doc->maxx; });
+        int y0 =
+            FirstWhere(0, ys, [&](int y) { return by + rowpos[y] + rowsize[y] > doc->scrolly; });
+        int y1 = FirstWhere(y0, ys, [&](int y) { return by + rowpos[y] >= doc->maxy; });
+        return Selection(this, x0, y0, x1 - x0, y1 - y0);
+    }
+
     void FindXY(Document *doc, int px, int py, wxDC &dc) {
-        foreachcell(c) {
-            int bx = px - c->ox;
-            int by = py - c->oy;
-            if (bx >= 0 && by >= -g_line_width - g_selmargin && bx < c->sx && by < g_selmargin) {
+        // Only cells whose area including the borders around it contains the point can match.
+        auto hit = SelectAll();
+        if (IsLaidOut()) {
+            const int reach = g_line_width + g_selmargin;
+            hit.x = FirstWhere(0, xs, [&](int x) { return px < colpos[x] + colsize[x] + reach; });
+            hit.xs = FirstWhere(hit.x, xs, [&](int x) { return px < colpos[x] - reach; }) - hit.x;
+            hit.y = FirstWhere(0, ys, [&](int y) { return py < rowpos[y] + rowsize[y] + reach; });
+            hit.ys = FirstWhere(hit.y, ys, [&](int y) { return py < rowpos[y] - reach; }) - hit.y;
+        }
+        foreachcellinsel(c, hit) {
+            auto &l = c->L();
+            int bx = px - l.ox;
+            int by = py - l.oy;
+            if (bx >= 0 && by >= -g_line_width - g_selmargin && bx < l.sx && by < g_selmargin) {
                 doc->hover = Selection(this, x, y, 1, 0);
                 return;
             }
-            if (bx >= 0 && by >= c->sy - g_selmargin && bx < c->sx &&
-                by < c->sy + g_line_width + g_selmargin) {
+            if (bx >= 0 && by >= l.sy - g_selmargin && bx < l.sx &&
+                by < l.sy + g_line_width + g_selmargin) {
                 doc->hover = Selection(this, x, y + 1, 1, 0);
                 return;
             }
-            if (bx >= -g_line_width - g_selmargin && by >= 0 && bx < g_selmargin && by < c->sy) {
+            if (bx >= -g_line_width - g_selmargin && by >= 0 && bx < g_selmargin && by < l.sy) {
                 doc->hover = Selection(this, x, y, 0, 1);
                 return;
             }
-            if (bx >= c->sx - g_selmargin && by >= 0 && bx < c->sx + g_line_width + g_selmargin &&
-                by < c->sy) {
+            if (bx >= l.sx - g_selmargin && by >= 0 && bx < l.sx + g_line_width + g_selmargin &&
+                by < l.sy) {
                 doc->hover = Selection(this, x + 1, y, 0, 1);
                 return;
             }
@@ -289,7 +486,7 @@ struct Grid {
                 if (doc->hover.grid) return;
                 doc->hover = Selection(this, x, y, 1, 1);
                 if (c->HasText()) {
-                    c->text.FindCursor(doc, bx, by - c->ycenteroff, dc, doc->hover, colwidths[x]);
+                    c->text.FindCursor(doc, bx, by - l.ycenteroff, dc, doc->hover, colwidths[x]);
                 }
                 return;
             }
@@ -308,40 +505,69 @@ struct Grid {
         return best;
     }
 
-    Cell *FindNextSearchMatch(const wxString &search, Cell *best, Cell *selected,
-                              bool &lastwasselected, bool reverse) {
-        if (reverse) {
-            foreachcellrev(c) best =
-                c->FindNextSearchMatch(search, best, selected, lastwasselected, reverse);
-        } else {
-            foreachcell(c) best =
-                c->FindNextSearchMatch(search, best, selected, lastwasselected, reverse);
-        }
-        return best;
-    }
-
     Cell *FindNextFilterMatch(Cell *best, Cell *selected, bool &lastwasselected) {
         foreachcell(c) best = c->FindNextFilterMatch(best, selected, lastwasselected);
         return best;
     }
 
-    void FindReplaceAll(const wxString &s, const wxString &ls) {
-        foreachcell(c) c->FindReplaceAll(s, ls);
+    void FindReplaceAll(Document *doc, const wxString &s, const wxString &ls) {
+        foreachcell(c) c->FindReplaceAll(doc, s, ls);
+    }
+
+    void IndexCells(int fromx = 0, int fromy = 0) {
+        if (unloaded) return;
+        for (int y = fromy; y < ys; y++)
+            for (int x = fromx; x < xs; x++)
+                if (auto c = C(x, y)) {
+                    c->gridx = x;
+                    c->gridy = y;
+                }
     }
 
-    void ReplaceCell(Cell *o, Cell *n) { foreachcell(c) if (c == o) c = n; }
+    // Checks the position cached on the cell, so lookups are O(1). Any structural change that
+    // did not keep it current is caught here, and then fixed for the whole grid in one pass.
+    bool IsIndexed(const Cell *o) const {
+        return o && o->gridx < xs && o->gridy < ys && cells[o->gridx + o->gridy * capx] == o;
+    }
+
+    bool Locate(const Cell *o) {
+        if (IsIndexed(o)) return true;
+        IndexCells();
+        return IsIndexed(o);
+    }
+
+    void ReplaceCell(Cell *o, Cell *n) {
+        if (!Locate(o)) return;
+        C(o->gridx, o->gridy) = n;
+        StatsChanged();
+        if (n) {
+            n->gridx = o->gridx;
+            n->gridy = o->gridy;
+        }
+    }
     Selection FindCell(Cell *o) {
-        foreachcell(c) if (c == o) return Selection(this, x, y, 1, 1);
-        return Selection();
+        return Locate(o) ? Selection(this, o->gridx, o->gridy, 1, 1) : Selection();
     }
 
     Selection SelectAll() { return Selection(this, 0, 0, xs, ys); }
+    // Like ImageRefCount(true), but keeps unloaded cells unloaded and counts all images they
+    // may use.
+    void MarkImages() {
+        if (unloaded) {
+            if (unloaded->hasimages)
+                for (auto image : *unloaded->context.images) image->trefc++;
+            return;
+        }
+        foreachcell(c) if (c) c->MarkImages();
+    }
+
     void ImageRefCount(bool includefolded) {
+        if (CanCopyUnloaded()) return;
         if (includefolded || !folded) foreachcell(c) c->ImageRefCount(includefolded);
     }
 
     void DrawCursor(Document *doc, wxDC &dc, Selection &sel, bool full, uint color) {
-        if (auto c = sel.GetCell(); c && !c->tiny && (c->HasText() || !c->grid))
+        if (auto c = sel.GetCell(); c && !c->L().tiny && (c->HasText() || !c->grid))
             c->text.DrawCursor(doc, dc, sel, full, color, colwidths[sel.x]);
     }
 
@@ -349,20 +575,20 @@ struct Grid {
         dc.SetPen(sys->pen_thinselect);
         if (!sel.xs) {
             auto c = C(sel.x - (sel.x == xs), sel.y);
-            int x = c->GetX(doc) + (c->sx + g_line_width + cell_margin) * (sel.x == xs) -
+            int x = c->GetX(doc) + (c->L().sx + g_line_width + cell_margin) * (sel.x == xs) -
                     g_line_width - cell_margin;
             loop(line, g_line_width)
                 dc.DrawLine(x + line, max(cell->GetY(doc), doc->scrolly), x + line,
-                            min(cell->GetY(doc) + cell->sy, doc->maxy));
-            DrawRectangle(dc, colour, x - 1, c->GetY(doc), g_line_width + 2, c->sy);
+                            min(cell->GetY(doc) + cell->L().sy, doc->maxy));
+            DrawRectangle(dc, colour, x - 1, c->GetY(doc), g_line_width + 2, c->L().sy);
         } else {
             auto c = C(sel.x, sel.y - (sel.y == ys));
-            int y = c->GetY(doc) + (c->sy + g_line_width + cell_margin) * (sel.y == ys) -
+            int y = c->GetY(doc) + (c->L().sy + g_line_width + cell_margin) * (sel.y == ys) -
                     g_line_width - cell_margin;
             loop(line, g_line_width)
                 dc.DrawLine(max(cell->GetX(doc), doc->scrollx), y + line,
-                            min(cell->GetX(doc) + cell->sx, doc->maxx), y + line);
-            DrawRectangle(dc, colour, c->GetX(doc), y - 1, c->sx, g_line_width + 2);
+                            min(cell->GetX(doc) + cell->L().sx, doc->maxx), y + line);
+            DrawRectangle(dc, colour, c->GetX(doc), y - 1, c->L().sx, g_line_width + 2);
         }
     }
 
@@ -371,27 +597,27 @@ struct Grid {
             if (sel.xs) {
                 if (sel.y < ys) {
                     auto tl = C(sel.x, sel.y);
-                    return wxRect(tl->GetX(doc), tl->GetY(doc), tl->sx, 0);
+                    return wxRect(tl->GetX(doc), tl->GetY(doc), tl->L().sx, 0);
                 } else {
                     auto br = C(sel.x, ys - 1);
-                    return wxRect(br->GetX(doc), br->GetY(doc) + br->sy, br->sx, 0);
+                    return wxRect(br->GetX(doc), br->GetY(doc) + br->L().sy, br->L().sx, 0);
                 }
             } else {
                 if (sel.x < xs) {
                     auto tl = C(sel.x, sel.y);
-                    return wxRect(tl->GetX(doc), tl->GetY(doc), 0, tl->sy);
+                    return wxRect(tl->GetX(doc), tl->GetY(doc), 0, tl->L().sy);
                 } else {
                     auto br = C(xs - 1, sel.y);
-                    return wxRect(br->GetX(doc) + br->sx, br->GetY(doc), 0, br->sy);
+                    return wxRect(br->GetX(doc) + br->L().sx, br->GetY(doc), 0, br->L().sy);
                 }
             }
         } else {
             auto tl = C(sel.x, sel.y);
             auto br = C(sel.x + sel.xs - 1, sel.y + sel.ys - 1);
             wxRect r(tl->GetX(doc) - cell_margin, tl->GetY(doc) - cell_margin,
-                     br->GetX(doc) + br->sx - tl->GetX(doc) + cell_margin * 2,
-                     br->GetY(doc) + br->sy - tl->GetY(doc) + cell_margin * 2);
-            if (minimal && tl == br) r.width -= tl->sx - tl->minx;
+                     br->GetX(doc) + br->L().sx - tl->GetX(doc) + cell_margin * 2,
+                     br->GetY(doc) + br->L().sy - tl->GetY(doc) + cell_margin * 2);
+            if (minimal && tl == br) r.width -= tl->L().sx - tl->L().minx;
             return r;
         }
     }
@@ -425,15 +651,37 @@ struct Grid {
     }
 
     void DeleteCells(int dx, int dy, int nxs, int nys) {
-        auto **ncells = new Cell *[(xs + nxs) * (ys + nys)];
-        auto **ncp = ncells;
-        foreachcell(c) if (x == dx || y == dy) DELETEP(c) else *ncp++ = c;
-        delete[] cells;
-        cells = ncells;
+        if (dy >= 0) {
+            loop(x, xs) DELETEP(C(x, dy));
+            for (int y = dy + 1; y < ys; y++) loop(x, xs) C(x, y - 1) = C(x, y);
+        }
+        if (dx >= 0) {
+            loop(y, ys) {
+                DELETEP(C(dx, y));
+                for (int x = dx + 1; x < xs; x++) C(x - 1, y) = C(x, y);
+            }
+        }
         xs += nxs;
         ys += nys;
         if (dx >= 0) colwidths.erase(colwidths.begin() + dx);
         SetOrient();
+        IndexCells(max(dx, 0), max(dy, 0));
+        StatsChanged();
+    }
+
+    // Makes room for nxs columns and nys rows. Capacity grows geometrically, so adding rows or
+    // columns one at a time moves every cell only a constant number of times on average.
+    void Reserve(int nxs, int nys) {
+        if (unloaded) Materialize();
+        if (nxs <= capx && nys <= capy) return;
+        auto ncapx = nxs > capx ? max(nxs, capx * 2) : capx;
+        auto ncapy = nys > capy ? max(nys, capy * 2) : capy;
+        auto **ncells = new Cell *[ncapx * ncapy];
+        loop(y, ys) loop(x, xs) ncells[x + y * ncapx] = cells[x + y * capx];
+        delete[] cells;
+        cells = ncells;
+        capx = ncapx;
+        capy = ncapy;
     }
 
     void MultiCellDelete(Document *doc, Selection &sel) {
@@ -487,28 +735,33 @@ struct Grid {
     void InsertCells(int dx, int dy, int nxs, int nys, Cell *nc = nullptr) {
         assert(((dx < 0) == (nxs == 0)) && ((dy < 0) == (nys == 0)));
         assert(nxs + nys == 1);
-        Cell **ocells = cells;
-        cells = new Cell *[(xs + nxs) * (ys + nys)];
+        Reserve(xs + nxs, ys + nys);
+        if (nys)
+            for (int y = ys; y > dy; y--) loop(x, xs) cells[x + y * capx] = C(x, y - 1);
+        else
+            loop(y, ys) for (int x = xs; x > dx; x--) cells[x + y * capx] = C(x - 1, y);
         xs += nxs;
         ys += nys;
-        Cell **ncp = ocells;
         SetOrient();
-        foreachcell(c) if (x == dx || y == dy) {
-            if (nc)
+        // new cells take their style from the row or column before them, or else after them
+        auto from = nxs ? (dx ? dx - 1 : 1) : (dy ? dy - 1 : 1);
+        loop(i, nxs ? ys : xs) {
+            auto &c = nxs ? C(dx, i) : C(i, dy);
+            if (nc) {
                 c = nc;
-            else {
-                Cell *colcell = ocells[(nxs ? max(0, min(dx - 1, xs - nxs - 1)) : x) +
-                                       (nxs ? y : max(0, min(dy - 1, ys - nys - 1))) * (xs - nxs)];
+            } else {
+                auto colcell = nxs ? C(from, i) : C(i, from);
                 c = new Cell(cell, colcell);
                 c->text.relsize = colcell->text.relsize;
             }
         }
-        else c = *ncp++;
-        delete[] ocells;
+        IndexCells(max(dx, 0), max(dy, 0));
         if (dx >= 0) colwidths.insert(colwidths.begin() + dx, cell->ColWidth());
+        StatsChanged();
     }
 
-    void Save(wxDataOutputStream &dos, Cell *ocs) const {
+    void Save(wxDataOutputStream &dos, const ImageIndex &images, const Cell *ocs,
+              bool withcells = true) const {
         dos.Write32(xs);
         dos.Write32(ys);
         dos.Write32(bordercolor);
@@ -516,19 +769,76 @@ struct Grid {
         dos.Write8(cell->verticaltextandgrid);
         dos.Write8(folded);
         loop(x, xs) dos.Write32(colwidths[x]);
-        foreachcell(c) c->Save(dos, ocs);
+        if (!withcells) return;
+        if (!folded) {
+            foreachcell(c) c->Save(dos, images, ocs);
+            return;
+        }
+        // folded cells go in a block of their own, so loading can keep it as is
+        if (CanCopyUnloaded()) {
+            SaveBlock(dos, *unloaded);
+            return;
+        }
+        UnloadedCells u;
+        u.hasimages = HasImages();
+        u.minrelsize = SavedMinRelsize();
+        u.stats = Stats();
+        wxMemoryOutputStream mos;
+        {
+            wxDataOutputStream bdos(mos);
+            foreachcell(c) c->Save(bdos, images, ocs);
+        }
+        u.data.resize(mos.GetSize());
+        mos.CopyTo(u.data.data(), u.data.size());
+        SaveBlock(dos, u);
+    }
+
+    static void SaveBlock(wxDataOutputStream &dos, const UnloadedCells &u) {
+        dos.Write8(u.hasimages);
+        dos.Write32(u.minrelsize);
+        dos.Write64(wxUint64(u.stats.cells));
+        dos.Write64(wxUint64(u.stats.chars));
+        dos.Write64(wxUint64(u.stats.words));
+        dos.Write64(wxUint64(u.stats.images));
+        dos.Write64(wxUint64(u.data.size()));
+        dos.Write8(u.data.data(), u.data.size());
+    }
+
+    // Loads everything Save would load, so that the save never has to do it off the UI thread.
+    // This walks the whole document on every save, though it only loads what is unloaded and
+    // can't be copied as is.
+    void MaterializeForSave() const {
+        if (CanCopyUnloaded()) return;
+        foreachcell(c) if (c->grid) c->grid->MaterializeForSave();
+    }
+
+    bool HasImages() const {
+        if (unloaded) return unloaded->hasimages;
+        foreachcell(c) if (c->text.image || (c->grid && c->grid->HasImages())) return true;
+        return false;
+    }
+
+    // MinRelsize without the cache, for Save
+    int SavedMinRelsize() const {
+        if (unloaded) return unloaded->minrelsize;
+        auto rs = INT_MAX;
+        foreachcell(c) rs = min(rs, c->grid      ? c->grid->SavedMinRelsize()
+                                    : c->HasText() ? c->text.relsize
+                                                   : INT_MAX);
+        return rs;
     }
 
-    bool LoadContents(wxDataInputStream &dis, int &numcells, int &textbytes, Cell *&ics) {
-        if (sys->versionlastloaded >= 10) {
+    bool LoadContents(wxDataInputStream &dis, const LoadContext &lc, int &numcells,
+                      int &textbytes, Cell *&ics, bool withcells) {
+        if (lc.version >= 10) {
             bordercolor = dis.Read32() & 0xFFFFFF;
             user_grid_outer_spacing = dis.Read32();
-            if (sys->versionlastloaded >= 11) {
+            if (lc.version >= 11) {
                 cell->verticaltextandgrid = dis.Read8() != 0;
-                if (sys->versionlastloaded >= 13) {
-                    if (sys->versionlastloaded >= 16) {
+                if (lc.version >= 13) {
+                    if (lc.version >= 16) {
                         folded = dis.Read8() != 0;
-                        if (folded && sys->versionlastloaded <= 17) {
+                        if (folded && lc.version <= 17) {
                             // Before v18, folding would use the image slot. So if this cell
                             // contains an image, clear it.
                             cell->text.image = nullptr;
@@ -538,8 +848,26 @@ struct Grid {
                 }
             }
         }
-        foreachcell(
-            c) if (!(c = Cell::LoadWhich(dis, cell, numcells, textbytes, ics))) return false;
+        if (!withcells) return true;
+        if (folded && lc.version >= 25) {
+            auto u = make_shared<UnloadedCells>();
+            u->hasimages = dis.Read8() != 0;
+            u->minrelsize = dis.Read32();
+            u->stats.cells = dis.Read64();
+            u->stats.chars = dis.Read64();
+            u->stats.words = dis.Read64();
+            u->stats.images = dis.Read64();
+            u->data.resize(dis.Read64());
+            dis.Read8(u->data.data(), u->data.size());
+            u->context = lc;
+            unloaded = std::move(u);
+            return true;
+        }
+        foreachcell(c) {
+            if (!(c = Cell::LoadWhich(dis, lc, cell, numcells, textbytes, ics))) return false;
+            c->gridx = x;
+            c->gridy = y;
+        }
         return true;
     }
 
@@ -595,31 +923,59 @@ struct Grid {
         return r;
     }
 
-    void RelSize(int dir, int zoomdepth) { foreachcell(c) c->RelSize(dir, zoomdepth); }
+    void RelSize(int dir, int zoomdepth) {
+        relsizedirty = true;
+        foreachcell(c) c->RelSize(dir, zoomdepth);
+    }
     void RelSize(int dir, const Selection &sel, int zoomdepth) {
+        relsizedirty = true;
         foreachcellinsel(c, sel) c->RelSize(dir, zoomdepth);
     }
     void SetBorder(int width, const Selection &sel) {
         foreachcellinsel(c, sel) c->SetBorder(width);
     }
     int MinRelsize(int rs) {
-        foreachcell(c) {
-            int crs = c->MinRelsize();
-            rs = min(rs, crs);
+        if (unloaded) return min(rs, unloaded->minrelsize);
+        if (relsizedirty) {
+            minrelsize = INT_MAX;
+            foreachcell(c) {
+                int crs = c->MinRelsize();
+                minrelsize = min(minrelsize, crs);
+            }
+            relsizedirty = false;
         }
-        return rs;
+        return min(rs, minrelsize);
     }
 
     void ResetChildren() {
         cell->Reset();
-        foreachcell(c) c->ResetChildren();
+        if (!unloaded) foreachcell(c) c->ResetChildren();
+    }
+
+    void DropLayout() {
+        vector<int>().swap(colpos);
+        vector<int>().swap(colsize);
+        vector<int>().swap(rowpos);
+        vector<int>().swap(rowsize);
+        vector<DirtyCell>().swap(dirtycells);
+        alldirty = false;
+        if (!unloaded) foreachcell(c) c->DropLayout();
     }
 
     void Move(int dx, int dy, const Selection &sel) {
+        auto swapcell = [&](Cell *&c, int x, int y) {
+            int nx = (x + dx + xs) % xs, ny = (y + dy + ys) % ys;
+            auto &n = C(nx, ny);
+            swap_(c, n);
+            c->gridx = x;
+            c->gridy = y;
+            n->gridx = nx;
+            n->gridy = ny;
+        };
         if (dx < 0 || dy < 0)
-            foreachcellinsel(c, sel) swap_(c, C((x + dx + xs) % xs, (y + dy + ys) % ys));
+            foreachcellinsel(c, sel) swapcell(c, x, y);
         else
-            foreachcellinselrev(c, sel) swap_(c, C((x + dx + xs) % xs, (y + dy + ys) % ys));
+            foreachcellinselrev(c, sel) swapcell(c, x, y);
     }
 
     void Add(Cell *c) {
@@ -649,6 +1005,7 @@ struct Grid {
             c->parent = p->cell;
             c = nullptr;
         }
+        p->StatsChanged();
         sel.grid = p;
         sel.xs += xs - 1;
         sel.ys += ys - 1;
@@ -657,7 +1014,7 @@ struct Grid {
     }
 
     void SetStyle(Document *doc, const Selection &sel, int sb) {
-        cell->AddUndo(doc);
+        cell->AddUndo(doc, sel);
         cell->ResetChildren();
         foreachcellinsel(c, sel) {
             c->text.stylebits ^= sb;
@@ -667,14 +1024,14 @@ struct Grid {
     }
 
     void ColorChange(Document *doc, int which, uint color, const Selection &sel) {
-        cell->AddUndo(doc);
+        cell->AddUndo(doc, sel);
         cell->ResetChildren();
         foreachcellinsel(c, sel) c->ColorChange(doc, which, color);
         doc->canvas->Refresh();
     }
 
     void ReplaceStr(Document *doc, const wxString &s, const wxString &ls, const Selection &sel) {
-        cell->AddUndo(doc);
+        cell->AddUndo(doc, sel);
         cell->ResetChildren();
         foreachcellinsel(c, sel) c->text.ReplaceStr(s, ls);
         doc->canvas->Refresh();
@@ -719,7 +1076,7 @@ struct Grid {
                 }
                 if (x >= xs) InsertCells(x, -1, 1, 0);
                 auto c = C(x, cy);
-                c->text.t = word;
+                c->text.SetText(word);
             }
             cy++;
         }
@@ -739,7 +1096,7 @@ struct Grid {
                 if (vert) return acc;  // (Reject vertical assignments)
                 // If we have no data, lets see if we can generate something useful from the
                 // subgrid.
-                if (!acc->grid && acc->text.t.IsEmpty()) {
+                if (!acc->grid && acc->text.GetText().IsEmpty()) {
                     acc = c->Eval(ev);
                     if (!acc) { return nullptr; }
                 }
@@ -758,7 +1115,7 @@ struct Grid {
                 return acc;
             // Operation
             case CT_CODE: {
-                auto op = ev.FindOp(c->text.t);
+                auto op = ev.FindOp(c->text.GetText());
                 switch (op ? strlen(op->args) : -1) {
                     default: return nullptr;
                     case 0: return ev.Execute(op);
@@ -830,7 +1187,7 @@ struct Grid {
         loop(i, vert ? xs : ys) gs.push_back(make_unique<Grid>(vert ? 1 : xs, vert ? ys : 1));
         foreachcell(c) {
             auto g = gs[vert ? x : y].get();
-            g->cells[vert ? y : x] = c->SetParent(g->cell);
+            g->C(vert ? 0 : x, vert ? y : 0) = c->SetParent(g->cell);
             c = nullptr;
         }
     }
@@ -851,14 +1208,19 @@ struct Grid {
         delete[] cells;
         cells = tr;
         swap_(xs, ys);
+        capx = xs;
+        capy = ys;
         SetOrient();
         InitColWidths();
+        IndexCells();
+        StatsChanged();
     }
 
     static int sortfunc(const Cell **a, const Cell **b) {
         loop(i, sys->sortxs) {
             int off = (i + sys->sortcolumn) % sys->sortxs;
-            int cmp = (*(a + off))->text.t.CmpNoCase((*(b + off))->text.t);
+            int cmp =
+                wxString((*(a + off))->text.GetText()).CmpNoCase((*(b + off))->text.GetText());
             if (cmp) return sys->sortdescending ? -cmp : cmp;
         }
         return 0;
@@ -868,8 +1230,9 @@ struct Grid {
         sys->sortcolumn = sel.x;
         sys->sortxs = xs;
         sys->sortdescending = descending;
-        qsort(cells + sel.y * xs, sel.ys, sizeof(Cell *) * xs,
+        qsort(cells + sel.y * capx, sel.ys, sizeof(Cell *) * capx,
               (int(__cdecl *)(const void *, const void *))sortfunc);
+        IndexCells();
     }
 
     Cell *FindExact(const wxString &s) {
@@ -891,7 +1254,7 @@ struct Grid {
                 for (auto p = f->parent; p != cell; p = p->parent) {
                     // Special case check: if parents have same name, this would cause infinite
                     // swapping.
-                    if (p->text.t == tag) done = true;
+                    if (p->text.GetText() == tag) done = true;
                     auto t = new Cell(f, p);
                     t->text = p->text;
                     t->text.cell = t;
@@ -907,6 +1270,7 @@ struct Grid {
                 if (!*cells) {
                     *cells = f;
                     f->parent = cell;
+                    f->StatsChanged();
                     selcell = f;
                 } else {
                     MergeTagCell(f, selcell);
@@ -946,7 +1310,7 @@ struct Grid {
     }
 
     void MergeTagCell(Cell *f, Cell *&selcell) {
-        foreachcell(c) if (c->text.t == f->text.t) {
+        foreachcell(c) if (c->text.GetText() == f->text.GetText()) {
             if (!selcell) selcell = c;
 
             if (f->grid) {
@@ -956,6 +1320,7 @@ struct Grid {
                     c->grid = f->grid;
                     c->grid->ReParent(c);
                     f->grid = nullptr;
+                    c->StatsChanged();
                 }
                 delete f;
             }
@@ -990,7 +1355,7 @@ struct Grid {
             }
             auto c = C(0, y);
             loop(prevy, y) {
-                if (auto prev = C(0, prevy); prev->text.t == c->text.t) {
+                if (auto prev = C(0, prevy); prev->text.GetText() == c->text.GetText()) {
                     if (rest) {
                         ASSERT(prev->grid);
                         prev->grid->MergeRow(rest->grid);
@@ -1052,23 +1417,17 @@ struct Grid {
                 if (c->grid && hierarchical)
                     c->grid->ResizeColWidths(dir, c->grid->SelectAll(), hierarchical);
             }
+            ResetColumn(x);
         }
     }
 
-    int GetColWidth(Cell *ct) {
-        foreachcell(c) {
-            if (c == ct) return colwidths[x];
-        }
-        return 0;
-    }
+    // Cells wrap to their column width, relayout them when it changes.
+    void ResetColumn(int x) { loop(y, ys) C(x, y)->Reset(); }
+
+    int GetColWidth(Cell *ct) { return Locate(ct) ? colwidths[ct->gridx] : 0; }
 
     void SetColWidth(Cell *ct, int w) {
-        foreachcell(c) {
-            if (c == ct) {
-                colwidths[x] = w;
-                return;
-            }
-        }
+        if (Locate(ct)) colwidths[ct->gridx] = w;
     }
 
     void CollectCells(auto &itercells) { foreachcell(c) c->CollectCells(itercells); }
@@ -1083,7 +1442,11 @@ struct Grid {
             c->text.stylebits = o->text.stylebits;
             c->text.image = o->text.image;
         }
+        StatsChanged();
     }
 
-    void ClearImages(const Selection &sel) { foreachcellinsel(c, sel) c->text.image = nullptr; }
+    void ClearImages(const Selection &sel) {
+        foreachcellinsel(c, sel) c->text.image = nullptr;
+        StatsChanged();
+    }
 };
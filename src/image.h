@@ -1,53 +1,87 @@
 struct Image {
-    vector<uint8_t> data;
+    // never changed in place but replaced, so a background save can keep writing the old one
+    shared_ptr<const vector<uint8_t>> data;
     char type;
-    wxBitmap bm_display;
+    wxBitmap bm_display;  // decoded on demand, and dropped again by System::TrimImageCache
+    wxSize pixelsize;     // read from the header, so layout needn't decode
+    uint lastdrawn {0};   // System::drawgeneration
     int trefc {0};
-    int savedindex {-1};
-    uint64_t hash {0};
+    uint64_t hash {0};  // of the first 4KB, exported images are named after it, see SetData
 
     // This indicates a relative scale, where 1.0 means bitmap pixels match display pixels on
     // a low res 96 dpi display. On a high dpi screen it will look scaled up. Higher values
     // look better on most screens.
     // This is all relative to GetContentScalingFactor.
     double display_scale;
-    int pixel_width {0};
 
     Image(auto _hash, auto _sc, auto &&_data, auto _type)
-        : hash(_hash), display_scale(_sc), data(std::move(_data)), type(_type) {}
+        : hash(_hash),
+          display_scale(_sc),
+          data(make_shared<const vector<uint8_t>>(std::move(_data))),
+          type(_type) {
+        ReadPixelSize();
+    }
+
+    void ReadPixelSize() {
+        auto &[it, mime] = imagetypes.at(type);
+        pixelsize = ReadImageSize(*data, it);
+    }
 
     void ImageRescale(double scale) {
         auto &[it, mime] = imagetypes.at(type);
-        auto im = ConvertBufferToWxImage(data, it);
+        auto im = ConvertBufferToWxImage(*data, it);
         im.Rescale(im.GetWidth() * scale, im.GetHeight() * scale);
-        data = ConvertWxImageToBuffer(im, it);
-        hash = CalculateHash(data);
-        bm_display = wxNullBitmap;
+        SetData(ConvertWxImageToBuffer(im, it));
+    }
+
+    // The caller updates System::imageindex afterwards, see IndexImages.
+    void SetData(vector<uint8_t> &&_data) {
+        data = make_shared<const vector<uint8_t>>(std::move(_data));
+        hash = CalculateHash(*data);
+        ReadPixelSize();
+        DropBitmap();
     }
 
     void DisplayScale(double scale) {
         display_scale /= scale;
-        bm_display = wxNullBitmap;
+        DropBitmap();
     }
 
     void ResetScale(double scale) {
         display_scale = scale;
+        DropBitmap();
+    }
+
+    size_t BitmapBytes() { return size_t(bm_display.GetWidth()) * bm_display.GetHeight() * 4; }
+
+    void DropBitmap() {
+        if (bm_display.IsOk()) sys->imagecachebytes -= BitmapBytes();
         bm_display = wxNullBitmap;
     }
 
+    void Decode() {
+        if (bm_display.IsOk()) return;
+        auto &[it, mime] = imagetypes.at(type);
+        auto bm = ConvertBufferToWxBitmap(*data, it);
+        pixelsize = bm.GetSize();  // in case the header was wrong or unreadable
+        ScaleBitmap(bm, sys->frame->FromDIP(1.0) / display_scale, bm_display);
+        sys->imagecachebytes += BitmapBytes();
+        sys->TrimImageCache(this);
+    }
+
     wxBitmap &Display() {
-        // This might run in multiple threads in parallel
-        // so this function must not touch any global resources
-        // and callees must be thread-safe.
-        if (!bm_display.IsOk()) {
-            auto &[it, mime] = imagetypes.at(type);
-            auto bm = ConvertBufferToWxBitmap(data, it);
-            pixel_width = bm.GetWidth();
-            ScaleBitmap(bm, sys->frame->FromDIP(1.0) / display_scale, bm_display);
-        }
+        lastdrawn = sys->drawgeneration;
+        Decode();
         return bm_display;
     }
 
+    // Same rounding as ScaleBitmap in Decode.
+    wxSize DisplaySize() {
+        if (pixelsize == wxSize()) Decode();
+        auto scale = sys->frame->FromDIP(1.0) / display_scale;
+        return wxSize(int(pixelsize.x * scale), int(pixelsize.y * scale));
+    }
+
     bool ExportToDirectory(const wxString &directory) {
         wxString targetname = directory + wxString::Format("%llu", hash) + GetFileExtension();
         wxFFileOutputStream os(targetname, L"w+b");
@@ -55,7 +89,7 @@ struct Image {
             wxMessageBox(_(L"Error writing image file!"), targetname.wx_str(), wxOK, sys->frame);
             return false;
         }
-        os.Write(data.data(), data.size());
+        os.Write(data->data(), data->size());
         return true;
     }
 
@@ -67,3 +101,14 @@ struct Image {
         }
     }
 };
+
+// The index each image gets in the file or undo item being written, see Text::Save. Every save
+// has its own, so saves and undo packing never wait for each other.
+typedef unordered_map<const Image *, int> ImageIndex;
+
+// What loading cells needs besides the bytes: the version they were saved with and the images
+// their indices refer to, see Text::Load.
+struct LoadContext {
+    uchar version;
+    shared_ptr<const vector<Image *>> images;
+};
@@ -1,6 +1,6 @@
 #include "stdafx.h"
 
-static const auto TS_VERSION = 24;
+static const auto TS_VERSION = 25;
 static const auto g_grid_margin = 1;
 static const auto g_cell_margin = 2;
 static const auto g_margin_extra = 2;  // TODO, could make this configurable: 0/2/4/6
@@ -242,9 +242,14 @@ enum {
     A_AUTOEXPORT_HTML_WITHOUT_IMAGES,
     A_DRAGANDDROP,
     A_DEFAULTMAXCOLWIDTH,
+    A_IMAGECACHE,
+    A_UNDOMEMORY,
+    A_UNDODISK,
+    A_UNDOSTEPS,
     A_ADDSCRIPT,
     A_DETSCRIPT,
     A_SET_FIXED_FONT,
+    A_JOURNAL,
     A_NOP,
     A_TAGSET = 1000,  // and all values from here on
     A_SCRIPT = 2000,  // and all values from here on
@@ -325,11 +330,20 @@ struct treesheets {
     #include "tscanvas.h"
     #include "tsframe.h"
     #include "tsapp.h"
+
+    #ifdef TREESHEETS_BENCH
+        #include "bench.h"
+    #endif
 };
 
 treesheets::System *treesheets::sys = nullptr;
 treesheets::TreeSheetsScriptImpl treesheets::tssi;
 
+#ifdef TREESHEETS_BENCH
+// a console program, so the results written to stdout show up on Windows too
+IMPLEMENT_APP_CONSOLE(treesheets::BenchApp)
+#else
 IMPLEMENT_APP(treesheets::TSApp)
+#endif
 
 #include "events.h"
\ No newline at end of file
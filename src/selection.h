@@ -106,7 +106,7 @@ class Selection {
         ys = abs(a.y - b.y) + 1;
     }
 
-    int MaxCursor() { return int(GetCell()->text.t.Len()); }
+    int MaxCursor() { return int(GetCell()->text.GetText().Len()); }
 
     inline bool IsWordSep(wxChar ch) {
         // represents: !"#$%&'()*+,-./    :;<=>?@    [\]^    {|}~    `
@@ -141,8 +141,9 @@ class Selection {
                 int &curs = firstdx < 0 ? cursor : cursorend;
                 int c = curs + dx;
                 wxChar ch;
+                wxString text = GetCell()->text.GetText();
                 if (c >= 0 && c <= MaxCursor()) {
-                    ch = GetCell()->text.t[min(c, curs)];
+                    ch = text[min(c, curs)];
                     // TEXT_SPACE > TEXT_SEP > TEXT_CHAR > 0.
                     // Accepts smaller or equal type when positive, only equal when negative.
                     // in regex terms (space/sep/char = s/p/c): match (s+p*|s+c*|p+c*|c+)
@@ -151,7 +152,7 @@ class Selection {
                     for (;;) {
                         c += dx;
                         if (c < 0 || c > MaxCursor()) break;
-                        ch = GetCell()->text.t[min(c, curs)];
+                        ch = text[min(c, curs)];
                         int chtype = CharType(ch);
                         // type increase when positive or type change when negative => break
                         if (chtype > allowed && chtype != -allowed) break;
@@ -344,7 +345,7 @@ class Selection {
         if (Thin()) return doc->NoThin();
         grid->cell->AddUndo(doc);
         auto np = grid->CloneSel(*this).release();
-        grid->C(x, y)->text.t = ".";  // avoid this cell getting deleted
+        grid->C(x, y)->text.SetText(L".");  // avoid this cell getting deleted
         if (xs > 1) {
             Selection s(grid, x + 1, y, xs - 1, ys);
             grid->MultiCellDeleteSub(doc, s);
@@ -61,6 +61,8 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <clocale>
 #include <condition_variable>
 #include <filesystem>
@@ -72,12 +74,14 @@
 #include <mutex>
 #include <new>
 #include <queue>
+#include <random>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -92,4 +96,15 @@
     #include <mach-o/dyld.h>
 #endif
 
+#ifdef TREESHEETS_BENCH
+    #ifdef _WIN32
+        #include <psapi.h>
+        #ifdef _MSC_VER
+            #pragma comment(lib, "psapi")
+        #endif
+    #else
+        #include <sys/resource.h>
+    #endif
+#endif
+
 using namespace std;
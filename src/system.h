@@ -10,13 +10,17 @@ struct System {
     wxString defaultfixedfont {L"Courier New"};
     wxString defaultlang {wxEmptyString};
     wxString searchstring;
+    std::string searchutf8;  // searchstring, for Text::Matches
+    // counts changes to searchstring, cells cache their match per generation, see SetSearchString
+    uint searchgen {1};
+    uint searchnarrowfrom {1};
+    bool searchstringcasesensitive {true};
     unique_ptr<wxConfigBase> cfg;
     Evaluator evaluator;
     wxString clipboardcopy;
     unique_ptr<Cell> cellclipboard;
     vector<unique_ptr<Image>> imagelist;
-    vector<int> loadimageids;
-    uchar versionlastloaded {0};
+    unordered_multimap<uint64_t, int> imageindex;  // ImageKey of the data, see AddImageToList
     wxLongLong fakelasteditonload;
     wxPen pen_tinytext {wxColour(0x808080ul)};
     wxPen pen_gridborder {wxColour(0xb5a6a4)};
@@ -26,6 +30,16 @@ struct System {
     int roundness {3};
     int defaultmaxcolwidth {80};
     bool makebaks {true};
+    int imagecachemb {512};
+    size_t imagecachebytes {0};
+    uint drawgeneration {0};  // counts paints, see TrimImageCache
+    bool imagesdirty {false};  // images may have become unused, see CollectImages
+    long lastimagegc {wxGetLocalTime()};
+    // budgets for the undo history of each document, see Document::TrimUndo
+    int undomemorymb {100};
+    int undodiskmb {1000};
+    int undosteps {1000};
+    bool journal {false};
     bool totray {false};
     bool autosave {true};
     bool zoomscroll {false};
@@ -47,6 +61,8 @@ struct System {
     int sortdescending;
     std::set<wxString> watchedpaths;
     bool insidefiledialog {false};
+    std::thread savethread;  // see Document::SaveDB
+    unique_ptr<ThreadPool> workers;  // shared by background passes, see Workers
     struct TimerStruct : wxTimer {
         void Notify() {
             sys->SaveCheck();
@@ -59,6 +75,7 @@ struct System {
     Image *lastimage {nullptr};
     int customcolor {0xFFFFFF};
     int cursorcolor {0x00FF00};
+    uint fontgeneration {0};  // bumped when fonts or DPI change, see Document::CurrentFontKey
 
     System(bool portable)
         : cfg(portable ? (wxConfigBase *)new wxFileConfig(
@@ -78,6 +95,11 @@ struct System {
         defaultlang = cfg->Read(L"defaultlang", defaultlang);
         cfg->Read(L"defaultmaxcolwidth", &defaultmaxcolwidth, defaultmaxcolwidth);
         cfg->Read(L"makebaks", &makebaks, makebaks);
+        cfg->Read(L"imagecachemb", &imagecachemb, imagecachemb);
+        cfg->Read(L"undomemorymb", &undomemorymb, undomemorymb);
+        cfg->Read(L"undodiskmb", &undodiskmb, undodiskmb);
+        cfg->Read(L"undosteps", &undosteps, undosteps);
+        cfg->Read(L"journal", &journal, journal);
         cfg->Read(L"totray", &totray, totray);
         cfg->Read(L"zoomscroll", &zoomscroll, zoomscroll);
         cfg->Read(L"thinselc", &thinselc, thinselc);
@@ -111,6 +133,19 @@ struct System {
         newdoc->UpdateFileName();
     }
 
+    // A search that contains the previous one matches a subset of its cells, so cells that did
+    // not match since searchnarrowfrom don't have to be checked again.
+    void SetSearchString(const wxString &s) {
+        if (s == searchstring && searchstringcasesensitive == casesensitivesearch) return;
+        if (searchstring.IsEmpty() || s.Find(searchstring) < 0 ||
+            searchstringcasesensitive != casesensitivesearch)
+            searchnarrowfrom = searchgen + 1;
+        searchstring = s;
+        searchutf8 = s.utf8_str().data();
+        searchstringcasesensitive = casesensitivesearch;
+        searchgen++;
+    }
+
     void Init(const wxString &filename) {
         evaluator.Init();
 
@@ -162,6 +197,7 @@ struct System {
 
     wxString BakName(const wxString &filename) { return ExtName(filename, L".bak"); }
     wxString TmpName(const wxString &filename) { return ExtName(filename, L".tmp"); }
+    wxString JournalName(const wxString &filename) { return ExtName(filename, L".journal"); }
     wxString ExtName(const wxString &filename, auto ext) {
         wxFileName fn(filename);
         return fn.GetPathWithSep() + fn.GetName() + ext;
@@ -205,14 +241,15 @@ struct System {
             char buf[4];
             fis.Read(buf, 4);
             if (strncmp(buf, "TSFF", 4)) return _(L"Not a TreeSheets file.");
-            fis.Read(&versionlastloaded, 1);
-            if (versionlastloaded > TS_VERSION) return _(L"File of newer version.");
-            auto xs = versionlastloaded >= 21 ? dis.Read8() : 1;
-            auto ys = versionlastloaded >= 21 ? dis.Read8() : 1;
-            zoomlevel = versionlastloaded >= 23 ? dis.Read8() : 0;
+            uchar version = 0;
+            fis.Read(&version, 1);
+            if (version > TS_VERSION) return _(L"File of newer version.");
+            auto xs = version >= 21 ? dis.Read8() : 1;
+            auto ys = version >= 21 ? dis.Read8() : 1;
+            zoomlevel = version >= 23 ? dis.Read8() : 0;
             fakelasteditonload = wxDateTime::Now().GetValue();
 
-            loadimageids.clear();
+            vector<Image *> images;
 
             for (;;) {
                 fis.Read(buf, 1);
@@ -222,10 +259,10 @@ struct System {
                         char iti = *buf;
                         if (!imagetypes.contains(iti))
                             return _(L"Found an image type that is not defined in this program.");
-                        if (versionlastloaded < 9) dis.ReadString();
-                        auto sc = versionlastloaded >= 19 ? dis.ReadDouble() : 1.0;
+                        if (version < 9) dis.ReadString();
+                        auto sc = version >= 19 ? dis.ReadDouble() : 1.0;
                         vector<uint8_t> image_data;
-                        if (versionlastloaded >= 22) {
+                        if (version >= 22) {
                             auto imagelen = (size_t)dis.Read64();
                             image_data.resize(imagelen);
                             fis.Read(image_data.data(), imagelen);
@@ -261,17 +298,29 @@ struct System {
                         }
                         if (!fis.IsOk()) image_data.clear();
 
-                        loadimageids.push_back(AddImageToList(sc, std::move(image_data), iti));
+                        images.push_back(imagelist[AddImageToList(sc, std::move(image_data), iti)].get());
                         break;
                     }
 
+                    case 'C':
                     case 'D': {
-                        wxZlibInputStream zis(fis);
-                        if (!zis.IsOk()) return _(L"Cannot decompress file.");
-                        wxDataInputStream dis(zis);
+                        // kept by the folded grids that are loaded later
+                        LoadContext lc {version,
+                                        make_shared<const vector<Image *>>(std::move(images))};
                         auto numcells = 0, textbytes = 0;
-                        auto root = Cell::LoadWhich(dis, nullptr, numcells, textbytes, ics);
+                        Cell *root = nullptr;
+                        map<wxString, uint> tags;
+                        if (*buf == 'C') {
+                            root = LoadChunks(fis, lc, numcells, textbytes, ics, tags);
+                        } else {
+                            wxZlibInputStream zis(fis);
+                            if (!zis.IsOk()) return _(L"Cannot decompress file.");
+                            wxDataInputStream dis(zis);
+                            root = Cell::LoadWhich(dis, lc, nullptr, numcells, textbytes, ics);
+                            if (root) LoadTags(dis, version, tags);
+                        }
                         if (!root) return _(L"File corrupted!");
+                        auto torn = !loadedfromtmp && ReplayJournal(filename, root, ics, tags);
 
                         doc = NewTabDoc(true);
                         if (loadedfromtmp) {
@@ -280,15 +329,9 @@ struct System {
                             doc->modified = true;
                         }
                         doc->InitWith(root, filename, ics, xs, ys);
-
-                        if (versionlastloaded >= 11) {
-                            for (;;) {
-                                auto tag = dis.ReadString();
-                                if (!tag.Len()) break;
-                                doc->tags[tag] =
-                                    versionlastloaded >= 24 ? dis.Read32() : g_tagcolor_default;
-                            }
-                        }
+                        doc->tags = std::move(tags);
+                        doc->JournalBase();
+                        if (loadedfromtmp || torn) doc->JournalAll();
 
                         auto end_loading_time = wxGetLocalTimeMillis();
 
@@ -309,18 +352,6 @@ struct System {
 
     done:
 
-        doc->RefreshImageRefCount(false);
-        {
-            ThreadPool pool(std::thread::hardware_concurrency());
-            for (const auto &image : sys->imagelist) {
-                pool.enqueue(
-                    [](auto img) {
-                        if (img->trefc) img->Display();
-                    },
-                    image.get());
-            }
-        }  // wait until all tasks are finished
-
         FileUsed(filename, doc);
         doc->Zoom(zoomlevel, true);
         if (anyimagesfailed)
@@ -330,6 +361,210 @@ struct System {
         return L"";
     }
 
+    void LoadTags(wxDataInputStream &dis, uchar version, map<wxString, uint> &tags) {
+        if (version < 11) return;
+        for (;;) {
+            auto tag = dis.ReadString();
+            if (!tag.Len()) break;
+            tags[tag] = version >= 24 ? dis.Read32() : g_tagcolor_default;
+        }
+    }
+
+    // A journal starts with the size and modification time of the file it was written against,
+    // and is ignored when they no longer match.
+    bool JournalMatches(wxInputStream &fis, const wxString &filename, uchar &version) {
+        wxDataInputStream dis(fis);
+        char buf[4];
+        if (fis.Read(buf, 4).LastRead() != 4 || strncmp(buf, "TSJF", 4)) return false;
+        fis.Read(&version, 1);
+        if (version > TS_VERSION) return false;
+        wxFileName fn(filename);
+        auto size = dis.Read64();
+        auto time = dis.Read64();
+        return fis.IsOk() && fn.GetSize().GetValue() == size &&
+               fn.GetModificationTime().GetValue().GetValue() == wxLongLong_t(time);
+    }
+
+    // Applies the entries Document::JournalSave appended, each of which replaces one subtree. A
+    // torn entry at the end, from a crash while writing it, is ignored, and true returned so the
+    // next save rewrites the file instead of appending after it.
+    bool ReplayJournal(const wxString &filename, Cell *&root, Cell *&ics,
+                       map<wxString, uint> &tags) {
+        auto jn = JournalName(filename);
+        if (!::wxFileExists(jn)) return false;
+        wxFFileInputStream fis(jn);
+        uchar version = 0;
+        if (!fis.IsOk() || !JournalMatches(fis, filename, version)) return false;
+        wxDataInputStream dis(fis);
+        auto torn = true;
+        for (;;) {
+            char marker;
+            if (fis.Read(&marker, 1).LastRead() != 1) {
+                torn = false;
+                break;
+            }
+            if (marker != 'E') break;
+            auto len = dis.Read64();
+            if (!fis.IsOk() || len > wxUint64(fis.GetLength() - fis.TellI())) break;
+            vector<uint8_t> entry(len);
+            if (fis.Read(entry.data(), len).LastRead() != len) break;
+
+            wxMemoryInputStream mis(entry.data(), entry.size());
+            wxZlibInputStream zis(mis);
+            if (!zis.IsOk()) break;
+            wxDataInputStream edis(zis);
+            vector<pair<int, int>> path(min(edis.Read32(), 10000u));
+            for (auto &[x, y] : path) {
+                x = edis.Read32();
+                y = edis.Read32();
+            }
+            vector<Image *> images;
+            for (auto n = edis.Read32(); n && zis.IsOk(); n--) {
+                char type = edis.Read8();
+                auto scale = edis.ReadDouble();
+                vector<uint8_t> data(edis.Read64());
+                edis.Read8(data.data(), data.size());
+                images.push_back(imagelist[AddImageToList(scale, std::move(data), type)].get());
+            }
+            LoadContext lc {version, make_shared<const vector<Image *>>(std::move(images))};
+            Cell *parent = nullptr, *at = root;
+            for (auto [x, y] : path) {
+                if (!at->grid || x < 0 || y < 0 || x >= at->grid->xs || y >= at->grid->ys) {
+                    at = nullptr;
+                    break;
+                }
+                parent = at;
+                at = at->grid->C(x, y);
+            }
+            if (!at || !zis.IsOk()) break;
+            auto numcells = 0, textbytes = 0;
+            Cell *eics = nullptr;
+            auto c = Cell::LoadWhich(edis, lc, parent, numcells, textbytes, eics);
+            if (!c) break;
+            for (auto p = ics; p; p = p->parent)
+                if (p == at) ics = nullptr;
+            if (parent) {
+                auto [x, y] = path.back();
+                parent->grid->C(x, y) = c;
+                c->gridx = x;
+                c->gridy = y;
+            } else
+                root = c;
+            delete at;
+            tags.clear();
+            LoadTags(edis, version, tags);
+        }
+        return torn;
+    }
+
+    static vector<uint8_t> Deflate(auto write, int level = 9) {
+        wxMemoryOutputStream mos;
+        {
+            wxZlibOutputStream zos(mos, level);
+            if (!zos.IsOk()) return {};
+            wxDataOutputStream dos(zos);
+            write(dos);
+        }
+        vector<uint8_t> buf(mos.GetSize());
+        mos.CopyTo(buf.data(), buf.size());
+        return buf;
+    }
+
+    // Since version 25 the body is a table of chunk sizes and cell counts followed by the chunks,
+    // each deflated separately: first the root without the cells of its grid and the tags, then
+    // runs of consecutive cells of the root's grid in order. Those are inflated and parsed in
+    // parallel and then put into the grid.
+    Cell *LoadChunks(wxInputStream &fis, const LoadContext &lc, int &numcells, int &textbytes,
+                     Cell *&ics, map<wxString, uint> &tags) {
+        wxDataInputStream dis(fis);
+        auto n = dis.Read32();
+        auto entrysize = 12;  // size and cell count
+        auto left = fis.GetLength() - fis.TellI();
+        if (!n || !fis.IsOk() || wxFileOffset(n) * entrysize > left) return nullptr;
+        left -= wxFileOffset(n) * entrysize;
+        vector<vector<uint8_t>> chunks(n);
+        vector<size_t> counts(n);
+        size_t total = 0;
+        loop(i, n) {
+            auto len = dis.Read64();
+            if (len > wxUint64(left)) return nullptr;
+            chunks[i].resize(len);
+            left -= len;
+            counts[i] = dis.Read32();
+            if (!counts[i]) return nullptr;
+            if (i) total += counts[i];
+        }
+        for (auto &chunk : chunks)
+            if (fis.Read(chunk.data(), chunk.size()).LastRead() != chunk.size()) return nullptr;
+
+        struct Loaded {
+            vector<Cell *> cells;
+            int numcells {0};
+            int textbytes {0};
+            Cell *ics {nullptr};
+            bool ok {false};
+        };
+        auto inflate = [&](size_t i, Cell *parent) {
+            Loaded l;
+            wxMemoryInputStream mis(chunks[i].data(), chunks[i].size());
+            wxZlibInputStream zis(mis);
+            if (!zis.IsOk()) return l;
+            wxDataInputStream dis(zis);
+            loop(j, counts[i]) {
+                auto c = Cell::LoadWhich(dis, lc, parent, l.numcells, l.textbytes, l.ics,
+                                         parent != nullptr);
+                if (!c) return l;
+                l.cells.push_back(c);
+            }
+            if (!parent) LoadTags(dis, lc.version, tags);
+            l.ok = true;
+            return l;
+        };
+        auto merge = [&](const Loaded &l) {
+            numcells += l.numcells;
+            textbytes += l.textbytes;
+            if (l.ics) ics = l.ics;
+        };
+
+        if (counts[0] != 1) return nullptr;
+        auto top = inflate(0, nullptr);
+        if (!top.ok) return nullptr;
+        merge(top);
+        auto root = top.cells[0];
+        auto g = root->grid;
+        if (total != (g ? size_t(g->xs) * g->ys : 0)) {
+            delete root;
+            return nullptr;
+        }
+        if (!g) return root;
+        vector<std::future<Loaded>> loading;
+        {
+            ThreadPool pool(max(1u, std::thread::hardware_concurrency()));
+            for (size_t i = 1; i < chunks.size(); i++)
+                loading.push_back(pool.enqueue([&](size_t i) { return inflate(i, root); }, i));
+        }  // wait until all tasks are finished
+        auto ok = true;
+        size_t next = 0;
+        for (auto &f : loading) {
+            auto l = f.get();
+            merge(l);
+            ok = ok && l.ok;
+            for (auto c : l.cells) {
+                if (!ok) {  // only the cells put in the grid are deleted with it
+                    delete c;
+                    continue;
+                }
+                c->gridx = int(next % g->xs);
+                c->gridy = int(next / g->xs);
+                g->C(c->gridx, c->gridy) = c;
+                next++;
+            }
+        }
+        if (ok) return root;
+        delete root;
+        return nullptr;
+    }
+
     void FileUsed(const wxString &filename, Document *doc) {
         frame->filehistory.AddFileToHistory(filename);
         if (fswatch) {
@@ -365,16 +600,55 @@ struct System {
         cfg->Flush();
     }
 
+    ThreadPool &Workers() {
+        if (!workers)
+            workers = make_unique<ThreadPool>(max(1u, std::thread::hardware_concurrency()));
+        return *workers;
+    }
+
+    void WaitForSave() {
+        if (savethread.joinable()) savethread.join();
+    }
+
     void SaveCheck() {
         loop(i, frame->notebook->GetPageCount()) {
-            static_cast<TSCanvas *>(frame->notebook->GetPage(i))
-                ->doc->AutoSave(!frame->IsActive(), i);
+            auto doc = static_cast<TSCanvas *>(frame->notebook->GetPage(i))->doc;
+            doc->AutoSave(!frame->IsActive(), i);
+            // layouts of tabs in the background are only memory until they are shown again
+            if (doc->lastdrawn && doc->lastdrawn + 30 < wxGetLocalTime() &&
+                i != frame->notebook->GetSelection())
+                doc->DropLayout();
         }
+        // the walk covers every cell and undo item, so not more often than every 10 seconds
+        if (lastimagegc + (imagesdirty ? 10 : 300) < wxGetLocalTime()) CollectImages();
+    }
+
+    // Frees the images that no open document, undo or redo list, or the cell clipboard uses.
+    void CollectImages() {
+        imagesdirty = false;
+        lastimagegc = wxGetLocalTime();
+        if (imagelist.empty()) return;
+        for (auto &image : imagelist) image->trefc = 0;
+        if (lastimage) lastimage->trefc++;  // for A_LASTIMAGE
+        loop(i, frame->notebook->GetPageCount()) {
+            auto doc = static_cast<TSCanvas *>(frame->notebook->GetPage(i))->doc;
+            doc->root->MarkImages();
+            for (auto &ui : doc->undolist) ui->MarkImages();
+            for (auto &ui : doc->redolist) ui->MarkImages();
+        }
+        if (cellclipboard) cellclipboard->MarkImages();
+        auto before = imagelist.size();
+        std::erase_if(imagelist, [](auto &image) {
+            if (image->trefc) return false;
+            image->DropBitmap();
+            return true;
+        });
+        if (imagelist.size() != before) IndexImages();
     }
 
     void SaveAll() {
         loop(i, frame->notebook->GetPageCount()) {
-            frame->GetCurrentTab()->doc->Save(false);
+            frame->GetCurrentTab()->doc->Save(false, nullptr, true);
             frame->CycleTabs(1);
         }
     }
@@ -456,10 +730,12 @@ struct System {
     void FillXML(Cell *c, wxXmlNode *node, bool attributestoo) {
         const auto &words = wxStringTokenize(
             node->GetType() == wxXML_ELEMENT_NODE ? node->GetNodeContent() : node->GetContent());
+        wxString t = c->text.GetText();
         loop(i, words.GetCount()) {
-            if (c->text.t.Len()) c->text.t.Append(L' ');
-            c->text.t.Append(words[i]);
+            if (t.Len()) t.Append(L' ');
+            t.Append(words[i]);
         }
+        c->text.SetText(t);
 
         if (node->GetName() == L"cell") {
             c->text.relsize = -wxAtoi(node->GetAttribute(L"relsize", L"0"));
@@ -476,7 +752,7 @@ struct System {
         auto numrows = GetXMLNodes(node, nodes, &attributes, attributestoo);
         if (!numrows) return;
 
-        if (nodes.size() == 1 && (!c->text.t.Len() || nodes[0]->IsWhitespaceOnly()) &&
+        if (nodes.size() == 1 && (!c->text.GetText().Len() || nodes[0]->IsWhitespaceOnly()) &&
             nodes[0]->GetName() != L"row") {
             FillXML(c, nodes[0], attributestoo);
         } else {
@@ -502,7 +778,7 @@ struct System {
             } else {
                 c->AddGrid(1, numrows);
                 SetGridSettingsFromXML(c, node);
-                loopv(i, attributes) c->grid->C(0, i)->text.t = attributes[i]->GetValue();
+                loopv(i, attributes) c->grid->C(0, i)->text.SetText(attributes[i]->GetValue());
                 loopv(i, nodes)
                     FillXML(c->grid->C(0, i + attributes.size()), nodes[i], attributestoo);
             }
@@ -537,22 +813,53 @@ struct System {
             } else {
                 if (g->ys <= y) g->InsertCells(-1, y, 0, 1);
                 auto &t = g->C(0, y)->text;
-                t.t = s.Trim(false);
+                t.SetText(s.Trim(false));
                 y++;
             }
         }
         return static_cast<int>(as.size());
     }
 
+    // Image::hash only covers the first 4KB, so images that share those would all end up in one
+    // bucket. The index uses a hash of all the data instead.
+    static uint64_t ImageKey(const vector<uint8_t> &data) {
+        return WideHash64(data.data(), data.size());
+    }
+
     int AddImageToList(double scale, auto &&data, char iti) {
+        auto key = ImageKey(data);
+        for (auto [it, end] = imageindex.equal_range(key); it != end; it++)
+            if (*imagelist[it->second]->data == data) return it->second;
         auto hash = CalculateHash(data);
-        loopv(i, imagelist) {
-            if (imagelist[i]->hash == hash) return i;
-        }
         imagelist.push_back(make_unique<Image>(hash, scale, std::move(data), iti));
+        imageindex.emplace(key, imagelist.size() - 1);
         return imagelist.size() - 1;
     }
 
+    // After images changed their data, as entries for the old data never match anymore.
+    void IndexImages() {
+        imageindex.clear();
+        loopv(i, imagelist) imageindex.emplace(ImageKey(*imagelist[i]->data), i);
+    }
+
+    // Drops the bitmaps drawn longest ago until the decoded images fit the budget again, with some
+    // room to spare. Those drawn by the current paint are on screen and stay.
+    void TrimImageCache(const Image *keep = nullptr) {
+        auto budget = size_t(imagecachemb) << 20;
+        if (imagecachebytes <= budget) return;
+        vector<Image *> decoded;
+        for (auto &image : imagelist)
+            if (image->bm_display.IsOk() && image.get() != keep &&
+                image->lastdrawn != drawgeneration)
+                decoded.push_back(image.get());
+        std::sort(decoded.begin(), decoded.end(),
+                  [](auto a, auto b) { return a->lastdrawn < b->lastdrawn; });
+        for (auto image : decoded) {
+            if (imagecachebytes <= budget / 4 * 3) break;
+            image->DropBitmap();
+        }
+    }
+
     void ImageSize(wxBitmap *bm, int &xs, int &ys) {
         if (!bm) return;
         xs = bm->GetWidth();
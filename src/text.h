@@ -1,14 +1,139 @@
+// Cell text as UTF-8, which where wxString uses 4 bytes per character is a fraction of the size.
+// Up to 16 bytes are stored in place, so short and empty strings allocate nothing. Converts to a
+// wxString where it is handed to wx or edited.
+struct Utf8String {
+    uint32_t bytes {0};
+    uint32_t len {0};  // in wxString characters, which is what cursor positions count
+    union {
+        char local[16];
+        char *heap;
+    };
+
+    Utf8String() {}
+    Utf8String(const wxString &s) { Set(s); }
+    Utf8String(const Utf8String &o) { Set(o.Data(), o.bytes, o.len); }
+    Utf8String(Utf8String &&o) { Take(o); }
+    ~Utf8String() { Clear(); }
+
+    Utf8String &operator=(const Utf8String &o) {
+        if (this != &o) {
+            Clear();
+            Set(o.Data(), o.bytes, o.len);
+        }
+        return *this;
+    }
+    Utf8String &operator=(Utf8String &&o) {
+        if (this != &o) {
+            Clear();
+            Take(o);
+        }
+        return *this;
+    }
+    Utf8String &operator=(const wxString &s) {
+        Clear();
+        Set(s);
+        return *this;
+    }
+
+    bool OnHeap() const { return bytes > sizeof(local); }
+    const char *Data() const { return OnHeap() ? heap : local; }
+    size_t MemoryUse() const { return OnHeap() ? bytes : 0; }
+
+    void Set(const char *data, size_t n, size_t l) {
+        bytes = static_cast<uint32_t>(n);
+        len = static_cast<uint32_t>(l);
+        memcpy(OnHeap() ? (heap = new char[n]) : local, data, n);
+    }
+    void Set(const wxString &s) {
+        auto utf8 = s.utf8_str();
+        Set(utf8.data(), utf8.length(), s.Len());
+    }
+    void Take(Utf8String &o) {
+        bytes = o.bytes;
+        len = o.len;
+        memcpy(local, o.local, sizeof(local));  // copies heap along with it
+        o.bytes = o.len = 0;
+    }
+    void Clear() {
+        if (OnHeap()) delete[] heap;
+        bytes = len = 0;
+    }
+
+    operator wxString() const { return wxString::FromUTF8(Data(), bytes); }
+    std::string utf8_string() const { return std::string(Data(), bytes); }
+    size_t Len() const { return len; }
+    bool IsEmpty() const { return !bytes; }
+    bool empty() const { return !bytes; }
+    bool operator!() const { return !bytes; }
+    size_t Words() const {
+        size_t n = 0;
+        auto space = true;
+        for (auto p = Data(), e = p + bytes; p < e; p++) {
+            auto ws = isspace(uchar(*p)) != 0;
+            if (space && !ws) n++;
+            space = ws;
+        }
+        return n;
+    }
+    bool operator==(const Utf8String &o) const {
+        return bytes == o.bytes && !memcmp(Data(), o.Data(), bytes);
+    }
+    bool operator==(const wxString &s) const { return *this == Utf8String(s); }
+};
+
+// Identifies the font text was measured in, see Document::CurrentFontKey and Text::Measure.
+struct FontKey {
+    uint generation {0};  // System::fontgeneration
+    int textsize {0};
+    int stylebits {0};
+    bool shrunk {false};  // printing or scaled viewing, which pick a point smaller
+    bool operator==(const FontKey &o) const {
+        return generation == o.generation && textsize == o.textsize &&
+               stylebits == o.stylebits && shrunk == o.shrunk;
+    }
+};
+
 struct Text {
     Cell *cell {nullptr};
     Image *image {nullptr};
-    wxString t {wxEmptyString};
     int relsize {0};
     int stylebits {0};
     int extent {0};
     wxDateTime lastedit;
     bool filtered {false};
+    // whether t matches sys->searchstring, as of sys->searchgen, see IsInSearch
+    uint searchgen {0};
+    bool searchmatch {false};
+
+    // Word wrap of t for a column width, and the extent of each line in the font of fontkey.
+    // Shared between copies of this Text, so it is replaced rather than modified while shared.
+    struct Lines {
+        wxString text;  // t, converted once here rather than on every draw
+        vector<int> starts;  // one more than lens, the last is where a next line would start
+        vector<int> lens;
+        vector<wxSize> extents;
+        int maxcolwidth {0};
+        FontKey fontkey;
+    };
+    shared_ptr<Lines> linecache;
+
+    // Forgets what was derived from t, SetText does this whenever it changes.
+    void ResetLines() {
+        linecache.reset();
+        searchgen = 0;
+    }
 
-    void WasEdited() { lastedit = wxDateTime::Now(); }
+    const Utf8String &GetText() const { return t; }
+    void SetText(const wxString &s) {
+        t = s;
+        ResetLines();
+        if (cell) cell->StatsChanged();
+    }
+
+    void WasEdited() {
+        lastedit = wxDateTime::Now();
+        ResetLines();
+    }
 
     Text() { WasEdited(); }
 
@@ -17,13 +142,22 @@ struct Text {
                                                 : (image ? &image->Display() : nullptr);
     }
 
-    size_t EstimatedMemoryUse() {
-        ASSERT(wxUSE_UNICODE);
-        return sizeof(Text) + t.Length() * sizeof(wchar_t);
+    void ImageSize(int &ixs, int &iys) {
+        if (cell->grid && cell->grid->folded) {
+            sys->ImageSize(&sys->frame->foldicon, ixs, iys);
+        } else if (image) {
+            auto size = image->DisplaySize();
+            ixs = size.GetWidth();
+            iys = size.GetHeight();
+        }
+    }
+
+    size_t EstimatedMemoryUse() const {
+        return sizeof(Text) + t.MemoryUse();
     }
 
     double GetNum() {
-        std::wstringstream ss(t.ToStdWstring());
+        std::wstringstream ss(wxString(t).ToStdWstring());
         double r;
         ss >> r;
         return r;
@@ -49,7 +183,7 @@ struct Text {
         // If there were only zeroes, remove '.'.
         if (s.back() == '.') s.pop_back();
 
-        t = s;
+        SetText(s);
     }
 
     wxString htmlify(wxString &str) {
@@ -66,13 +200,14 @@ struct Text {
     }
 
     wxString ToText(int indent, const Selection &s, int format) {
-        wxString str = s.cursor != s.cursorend ? t.Mid(s.cursor, s.cursorend - s.cursor) : t;
+        wxString str = t;
+        if (s.cursor != s.cursorend) str = str.Mid(s.cursor, s.cursorend - s.cursor);
         if (format == A_EXPXML || format == A_EXPHTMLT || format == A_EXPHTMLTI ||
             format == A_EXPHTMLTE || format == A_EXPHTMLO || format == A_EXPHTMLB)
             str = htmlify(str);
         if (format == A_EXPHTMLTI && image)
             str.Prepend(L"<img src=\"data:" + imagetypes.at(image->type).second + ";base64," +
-                        wxBase64Encode(image->data.data(), image->data.size()) + "\" />");
+                        wxBase64Encode(image->data->data(), image->data->size()) + "\" />");
         else if (format == A_EXPHTMLTE && image) {
             wxString relsize = wxString::Format(
                 "%d%%", static_cast<int>(100.0 * sys->frame->FromDIP(1.0) / image->display_scale));
@@ -90,7 +225,7 @@ struct Text {
     }
 
     auto IsWord(wxChar c) { return wxIsalnum(c) || wxStrchr(L"_\"\'()", c) || wxIspunct(c); }
-    auto GetLinePart(int &currentpos, int breakpos, int limitpos) {
+    auto GetLinePart(const wxString &t, int &currentpos, int breakpos, int limitpos) {
         auto startpos = currentpos;
         currentpos = breakpos;
 
@@ -123,7 +258,7 @@ struct Text {
         return t.Mid(startpos, breakpos - startpos);
     }
 
-    wxString GetLine(auto &i, auto maxcolwidth) {
+    wxString GetLine(const wxString &t, auto &i, auto maxcolwidth) {
         auto l = static_cast<int>(t.Len());
 
         if (i >= l) return wxEmptyString;
@@ -132,57 +267,108 @@ struct Text {
             i = l;
             return t;
         }  // subsumed by the case below, but this case happens 90% of the time, so more optimal
-        if (l - i <= maxcolwidth) return GetLinePart(i, l, l);
+        if (l - i <= maxcolwidth) return GetLinePart(t, i, l, l);
 
         for (auto p = i + maxcolwidth; p >= i; p--)
-            if (!IsWord(t[p])) return GetLinePart(i, p, l);
+            if (!IsWord(t[p])) return GetLinePart(t, i, p, l);
 
         // A single word is > maxcolwidth. We split it up anyway.
         // This happens with long urls and e.g. Japanese text without spaces.
         // Should really do proper unicode linebreaking instead (see libunibreak),
         // but for now this is better than the old code below which allowed for arbitrary long
         // words.
-        return GetLinePart(i, min(i + maxcolwidth, l), l);
+        return GetLinePart(t, i, min(i + maxcolwidth, l), l);
 
         // for(int p = i+maxcolwidth; p<l;  p++) if (!IsWord(t[p])) return GetLinePart(i, p, l);  //
         // we arrive here only
         // if a single word is too big for maxcolwidth, so simply return that word
-        // return GetLinePart(i, l, l);     // big word was the last one
+        // return GetLinePart(t, i, l, l);     // big word was the last one
     }
 
-    void TextSize(wxDC &dc, int &sx, int &sy, int tiny, int &leftoffset, int maxcolwidth) {
+    const Lines &Wrap(int maxcolwidth) {
+        if (!linecache || linecache->maxcolwidth != maxcolwidth) {
+            auto wrap = make_shared<Lines>();
+            wrap->maxcolwidth = maxcolwidth;
+            wrap->starts.push_back(0);
+            wrap->text = t;
+            auto i = 0;
+            for (;;) {
+                auto curl = GetLine(wrap->text, i, maxcolwidth);
+                if (!curl.Len()) break;
+                wrap->lens.push_back(static_cast<int>(curl.Len()));
+                wrap->starts.push_back(i);
+            }
+            linecache = wrap;
+        }
+        return *linecache;
+    }
+
+    static wxString Line(const Lines &wrap, int l) {
+        return wrap.text.Mid(wrap.starts[l], wrap.lens[l]);
+    }
+
+    const Lines &Measure(wxDC &dc, const FontKey &fontkey, int maxcolwidth) {
+        Wrap(maxcolwidth);
+        if (linecache->fontkey != fontkey) {
+            if (linecache.use_count() > 1) linecache = make_shared<Lines>(*linecache);
+            auto &wrap = *linecache;
+            wrap.extents.resize(wrap.lens.size());
+            loopv(l, wrap.lens)
+                dc.GetTextExtent(Line(wrap, l), &wrap.extents[l].x, &wrap.extents[l].y);
+            wrap.fontkey = fontkey;
+        }
+        return *linecache;
+    }
+
+    void TextSize(Document *doc, wxDC &dc, int &sx, int &sy, int tiny, int &leftoffset,
+                  int maxcolwidth) {
         sx = sy = 0;
-        auto i = 0;
-        for (;;) {
-            auto curl = GetLine(i, maxcolwidth);
-            if (!curl.Len()) break;
-            int x, y;
-            if (tiny) {
-                x = static_cast<int>(curl.Len());
-                y = 1;
-            } else
-                dc.GetTextExtent(curl, &x, &y);
-            sx = max(x, sx);
-            sy += y;
-            leftoffset = y;
+        if (tiny) {
+            for (auto len : Wrap(maxcolwidth).lens) {
+                sx = max(len, sx);
+                sy++;
+                leftoffset = 1;
+            }
+            return;
+        }
+        for (auto &e : Measure(dc, doc->CurrentFontKey(), maxcolwidth).extents) {
+            sx = max(e.x, sx);
+            sy += e.y;
+            leftoffset = e.y;
         }
-        if (!tiny) sx += 4;
+        sx += 4;
     }
 
     bool IsInSearch() {
-        return sys->searchstring.Len() &&
-               (sys->casesensitivesearch ? t.Find(sys->searchstring)
-                                         : t.Lower().Find(sys->searchstring)) >= 0;
+        if (!sys->searchstring.Len()) return false;
+        if (searchgen == sys->searchgen) return searchmatch;
+        // a cell that did not match a narrower search before can't match this one either
+        if (searchgen < sys->searchnarrowfrom || searchmatch)
+            searchmatch = Matches(sys->searchutf8, sys->casesensitivesearch);
+        searchgen = sys->searchgen;
+        return searchmatch;
+    }
+
+    // Without the cache of IsInSearch, so it can run on other threads. s is UTF-8 like t, and
+    // lower case unless casesensitive. Only text beyond ASCII needs converting to lower it.
+    bool Matches(const std::string &s, bool casesensitive) const {
+        std::string_view text(t.Data(), t.bytes);
+        if (casesensitive) return text.find(s) != text.npos;
+        if (std::any_of(text.begin(), text.end(), [](char c) { return c & 0x80; }))
+            return wxString(t).Lower().Find(wxString::FromUTF8(s)) >= 0;
+        return std::search(text.begin(), text.end(), s.begin(), s.end(), [](char a, char b) {
+                   return tolower(uchar(a)) == b;
+               }) != text.end();
     }
 
     int Render(Document *doc, int bx, int by, int depth, wxDC &dc, int &leftoffset,
                int maxcolwidth) {
         auto ixs = 0, iys = 0;
-        if (!cell->tiny) sys->ImageSize(DisplayImage(), ixs, iys);
+        if (!cell->L().tiny) ImageSize(ixs, iys);
 
         if (ixs && iys) {
             sys->ImageDraw(DisplayImage(), dc, bx + 1 + g_margin_extra,
-                           by + (cell->tys - iys) / 2 + g_margin_extra);
+                           by + (cell->L().tys - iys) / 2 + g_margin_extra);
             ixs += 2;
             iys += 2;
         }
@@ -191,26 +377,26 @@ struct Text {
 
         doc->PickFont(dc, depth, relsize, stylebits);
 
-        auto h = cell->tiny ? 1 : dc.GetCharHeight();
+        auto h = cell->L().tiny ? 1 : dc.GetCharHeight();
         leftoffset = h;
-        auto i = 0;
+        auto &wrap = Wrap(maxcolwidth);
+        auto &text = wrap.text;
         auto lines = 0;
         auto searchfound = IsInSearch();
         auto istag = cell->IsTag(doc);
-        if (cell->tiny) {
+        if (cell->L().tiny) {
             if (searchfound)
                 dc.SetPen(*wxRED_PEN);
             else if (filtered)
                 dc.SetPen(*wxLIGHT_GREY_PEN);
             else if (istag)
-                dc.SetPen(wxColour(LightColor(doc->tags[t])));
+                dc.SetPen(wxColour(LightColor(doc->tags[text])));
             else
                 dc.SetPen(sys->pen_tinytext);
         }
-        for (;;) {
-            auto curl = GetLine(i, maxcolwidth);
-            if (!curl.Len()) break;
-            if (cell->tiny) {
+        for (; lines < static_cast<int>(wrap.lens.size()); lines++) {
+            auto curl = Line(wrap, lines);
+            if (cell->L().tiny) {
                 if (sys->fastrender) {
                     dc.DrawLine(bx + ixs, by + lines * h, bx + ixs + static_cast<int>(curl.Len()),
                                 by + lines * h);
@@ -236,16 +422,17 @@ struct Text {
                 else if (filtered)
                     dc.SetTextForeground(*wxLIGHT_GREY);
                 else if (istag)
-                    dc.SetTextForeground(wxColour(LightColor(doc->tags[t])));
+                    dc.SetTextForeground(wxColour(LightColor(doc->tags[text])));
                 else if (cell->textcolor)
                     dc.SetTextForeground(LightColor(cell->textcolor));  // FIXME: clean up
                 auto tx = bx + 2 + ixs;
                 auto ty = by + lines * h;
-                dc.DrawText(curl, tx + g_margin_extra, ty + g_margin_extra);
+                // long texts may extend far beyond the canvas, only draw lines in view
+                if (ty + h > doc->scrolly && ty < doc->maxy)
+                    dc.DrawText(curl, tx + g_margin_extra, ty + g_margin_extra);
                 if (searchfound || filtered || istag || cell->textcolor)
                     dc.SetTextForeground(sys->darkmode ? *wxWHITE : *wxBLACK);
             }
-            lines++;
         }
 
         return max(lines * h, iys);
@@ -256,18 +443,20 @@ struct Text {
         by -= g_margin_extra;
 
         auto ixs = 0, iys = 0;
-        if (!cell->tiny) sys->ImageSize(DisplayImage(), ixs, iys);
+        if (!cell->L().tiny) ImageSize(ixs, iys);
         if (ixs) ixs += 2;
 
         doc->PickFont(dc, cell->Depth() - doc->drawpath.size(), relsize, stylebits);
 
-        auto i = 0, linestart = 0;
+        auto &wrap = Wrap(maxcolwidth);
+        auto linestart = 0;
         auto line = by / dc.GetCharHeight();
         wxString ls;
 
-        loop(l, line + 1) {
-            linestart = i;
-            ls = GetLine(i, maxcolwidth);
+        if (line >= 0) {
+            auto l = min(line, static_cast<int>(wrap.lens.size()));
+            linestart = wrap.starts[l];
+            if (l < static_cast<int>(wrap.lens.size())) ls = Line(wrap, l);
         }
 
         for (;;) {
@@ -283,16 +472,16 @@ struct Text {
 
     void DrawCursor(Document *doc, wxDC &dc, Selection &s, bool full, uint color, int maxcolwidth) {
         auto ixs = 0, iys = 0;
-        if (!cell->tiny) sys->ImageSize(DisplayImage(), ixs, iys);
+        if (!cell->L().tiny) ImageSize(ixs, iys);
         if (ixs) ixs += 2;
         doc->PickFont(dc, cell->Depth() - doc->drawpath.size(), relsize, stylebits);
         auto h = dc.GetCharHeight();
         {
-            auto i = 0;
+            auto &wrap = Wrap(maxcolwidth);
             for (auto l = 0;; l++) {
-                auto start = i;
-                auto ls = GetLine(i, maxcolwidth);
-                auto len = static_cast<int>(ls.Len());
+                auto start = wrap.starts[l];
+                auto len = l < static_cast<int>(wrap.lens.size()) ? wrap.lens[l] : 0;
+                auto ls = wrap.text.Mid(start, len);
                 auto end = start + len;
 
                 if (s.cursor != s.cursorend) {
@@ -305,7 +494,7 @@ struct Text {
                         if (x1 != x2) {
                             int startx = cell->GetX(doc) + x1 + 2 + ixs + g_margin_extra;
                             int starty =
-                                cell->GetY(doc) + l * h + 1 + cell->ycenteroff + g_margin_extra;
+                                cell->GetY(doc) + l * h + 1 + cell->L().ycenteroff + g_margin_extra;
                             DrawRectangle(dc, color, startx, starty, x2 - x1, h - 1, true);
                             HintIMELocation(doc, startx, starty, h - 1, stylebits);
                         }
@@ -315,7 +504,8 @@ struct Text {
                     auto x = 0;
                     dc.GetTextExtent(ls, &x, nullptr);
                     int startx = cell->GetX(doc) + x + 1 + ixs + g_margin_extra;
-                    int starty = cell->GetY(doc) + l * h + 1 + cell->ycenteroff + g_margin_extra;
+                    int starty =
+                        cell->GetY(doc) + l * h + 1 + cell->L().ycenteroff + g_margin_extra;
                     DrawRectangle(dc, color, startx, starty, 2, h - 2);
                     HintIMELocation(doc, startx, starty, h - 2, stylebits);
                     break;
@@ -327,9 +517,11 @@ struct Text {
     }
 
     void ExpandToWord(Selection &s) {
-        if (!wxIsalnum(t[s.cursor])) return;
-        while (s.cursor > 0 && wxIsalnum(t[s.cursor - 1])) s.cursor--;
-        while (s.cursorend < static_cast<int>(t.Len()) && wxIsalnum(t[s.cursorend])) s.cursorend++;
+        wxString text = t;
+        if (!wxIsalnum(text[s.cursor])) return;
+        while (s.cursor > 0 && wxIsalnum(text[s.cursor - 1])) s.cursor--;
+        while (s.cursorend < static_cast<int>(text.Len()) && wxIsalnum(text[s.cursorend]))
+            s.cursorend++;
     }
 
     void SelectWord(Selection &s) {
@@ -347,7 +539,7 @@ struct Text {
     bool RangeSelRemove(Selection &s) {
         WasEdited();
         if (s.cursor != s.cursorend) {
-            t.Remove(s.cursor, s.cursorend - s.cursor);
+            SetText(wxString(t).Remove(s.cursor, s.cursorend - s.cursor));
             s.cursorend = s.cursor;
             return true;
         }
@@ -361,7 +553,7 @@ struct Text {
             auto x = max(0, min(s.x + dd[i * 2], s.grid->xs - 1));
             auto y = max(0, min(s.y + dd[i * 2 + 1], s.grid->ys - 1));
             auto c = s.grid->C(x, y);
-            if (c->text.t.Len()) {
+            if (c->text.GetText().Len()) {
                 relsize = c->text.relsize;
                 break;
             }
@@ -373,7 +565,9 @@ struct Text {
         if (!s.TextEdit()) Clear(doc, s);
         RangeSelRemove(s);
         if (!prevl && !keeprelsize) SetRelSize(s);
-        t.insert(s.cursor, ins);
+        wxString text = t;
+        text.insert(s.cursor, wxString(ins));
+        SetText(text);
         s.cursor = s.cursorend = s.cursor + static_cast<int>(ins.Len());
     }
     void Key(Document *doc, int k, Selection &s) {
@@ -384,12 +578,12 @@ struct Text {
 
     void Delete(Selection &s) {
         if (!RangeSelRemove(s))
-            if (s.cursor < static_cast<int>(t.Len())) { t.Remove(s.cursor, 1); };
+            if (s.cursor < static_cast<int>(t.Len())) SetText(wxString(t).Remove(s.cursor, 1));
     }
     void Backspace(Selection &s) {
         if (!RangeSelRemove(s))
             if (s.cursor > 0) {
-                t.Remove(--s.cursor, 1);
+                SetText(wxString(t).Remove(--s.cursor, 1));
                 --s.cursorend;
             };
     }
@@ -403,6 +597,7 @@ struct Text {
     }
 
     void ReplaceStr(const wxString &str, const wxString &lstr) {
+        wxString t = this->t;
         if (sys->casesensitivesearch) {
             for (auto i = 0, j = 0; (j = t.Mid(i).Find(sys->searchstring)) >= 0;) {
                 // does this need WasEdited()?
@@ -423,21 +618,20 @@ struct Text {
                 i += str.Len();
             }
         }
+        SetText(t);
     }
 
     void Clear(Document *doc, Selection &s) {
-        t.Clear();
+        SetText(wxEmptyString);
         s.EnterEdit(doc);
     }
 
     void HomeEnd(Selection &s, bool home) {
-        auto i = 0;
-        auto cw = cell->ColWidth();
+        auto &wrap = Wrap(cell->ColWidth());
         auto findwhere = home ? s.cursor : s.cursorend;
-        for (;;) {
-            auto start = i;
-            auto curl = GetLine(i, cw);
-            if (!curl.Len()) break;
+        loopv(l, wrap.lens) {
+            auto start = wrap.starts[l];
+            auto i = wrap.starts[l + 1];
             auto end = i == t.Len() ? i : i - 1;
             if (findwhere >= start && findwhere <= end) {
                 s.cursor = s.cursorend = home ? start : end;
@@ -446,32 +640,37 @@ struct Text {
         }
     }
 
-    void Save(wxDataOutputStream &dos) const {
-        dos.WriteString(t.wx_str());
+    void Save(wxDataOutputStream &dos, const ImageIndex &images) const {
+        // the same as WriteString, without converting to a wxString and back
+        dos.Write32(t.bytes);
+        dos.Write8(reinterpret_cast<const wxUint8 *>(t.Data()), t.bytes);
         dos.Write32(relsize);
-        dos.Write32(image ? image->savedindex : -1);
+        auto it = image ? images.find(image) : images.end();
+        dos.Write32(it != images.end() ? it->second : -1);
         dos.Write32(stylebits);
         wxLongLong le = lastedit.GetValue();
         dos.Write64(&le, 1);
     }
 
-    void Load(wxDataInputStream &dis) {
+    void Load(wxDataInputStream &dis, const LoadContext &lc) {
+        // not SetText, new grids count their cells anyway and loading may run on many threads
         t = dis.ReadString();
+        ResetLines();
 
         // if (t.length() > 10000)
         //    printf("");
 
-        if (sys->versionlastloaded <= 11) dis.Read32();  // numlines
+        if (lc.version <= 11) dis.Read32();  // numlines
 
         relsize = dis.Read32();
 
         int i = dis.Read32();
-        image = i >= 0 ? sys->imagelist[sys->loadimageids[i]].get() : nullptr;
+        image = i >= 0 ? (*lc.images)[i] : nullptr;
 
-        if (sys->versionlastloaded >= 7) stylebits = dis.Read32();
+        if (lc.version >= 7) stylebits = dis.Read32();
 
         wxLongLong time;
-        if (sys->versionlastloaded >= 14) {
+        if (lc.version >= 14) {
             dis.Read64(&time, 1);
         } else {
             time = sys->fakelasteditonload--;
@@ -487,7 +686,7 @@ struct Text {
                 if (!v) {
                     v = cell->Clone(nullptr);
                     v->celltype = CT_DATA;
-                    v->text.t = "**Variable Load Error**";
+                    v->text.SetText(L"**Variable Load Error**");
                 }
                 return v;
             }
@@ -498,4 +697,7 @@ struct Text {
             default: return unique_ptr<Cell>();
         }
     }
+
+  private:
+    Utf8String t;  // only through SetText, so the caches above can't go stale
 };
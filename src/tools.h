@@ -100,6 +100,125 @@ inline uchar *loadfile(const char *fn, size_t *lenret = nullptr) {
     return buf;
 }
 
+// Hands out blocks of one size, carved from 64KB slabs, and keeps freed ones on a list for
+// reuse. Documents are made of millions of cells and grids, which the general heap spends
+// more time and memory on than a pool. Each thread allocates from a Cache of its own, which
+// trades blocks with the shared list in batches, so that the workers of LoadChunks meet at
+// the lock once per CACHE_BLOCKS / 2 cells rather than for each. The slabs are released all
+// at once when every block is back on the shared list, for example after the last document
+// was closed.
+class BlockPool {
+    struct Free {
+        Free *next;
+    };
+    size_t blocksize;
+    size_t slabblocks;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    Free *freelist {nullptr};
+    size_t used {0};  // blocks not on freelist, including those in caches
+    std::atomic<size_t> live {0};  // blocks handed out by caches and not released yet
+    std::mutex mutex;
+
+    // Moves n blocks from the shared list to the front of a cache's list.
+    void Take(Free *&list, size_t &count, size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto i = n; i--;) {
+            if (!freelist) {
+                slabs.emplace_back(new char[blocksize * slabblocks]);
+                auto slab = slabs.back().get();
+                for (auto j = slabblocks; j-- > 0;) {
+                    auto f = reinterpret_cast<Free *>(slab + j * blocksize);
+                    f->next = freelist;
+                    freelist = f;
+                }
+            }
+            auto f = freelist;
+            freelist = f->next;
+            f->next = list;
+            list = f;
+        }
+        count += n;
+        used += n;
+    }
+
+    // Moves n blocks from the front of a cache's list back to the shared list.
+    void Give(Free *&list, size_t &count, size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto i = n; i--;) {
+            auto f = list;
+            list = f->next;
+            f->next = freelist;
+            freelist = f;
+        }
+        count -= n;
+        if (!(used -= n)) {  // no cache can point into the slabs now
+            freelist = nullptr;
+            slabs.clear();
+        }
+    }
+
+  public:
+    enum { CACHE_BLOCKS = 256 };
+
+    explicit BlockPool(size_t size)
+        : blocksize((max(size, sizeof(Free)) + alignof(std::max_align_t) - 1) &
+                    ~(alignof(std::max_align_t) - 1)),
+          slabblocks(max(size_t(65536) / blocksize, size_t(1))) {}
+
+    // The blocks one thread has to itself, no more than CACHE_BLOCKS. Given back when the
+    // thread exits, or when the last block in use is released on it.
+    class Cache {
+        BlockPool &pool;
+        Free *list {nullptr};
+        size_t count {0};
+
+      public:
+        explicit Cache(BlockPool &_pool) : pool(_pool) {}
+        ~Cache() {
+            if (count) pool.Give(list, count, count);
+        }
+
+        void *Alloc() {
+            if (!count) pool.Take(list, count, CACHE_BLOCKS / 2);
+            auto f = list;
+            list = f->next;
+            count--;
+            pool.live.fetch_add(1, std::memory_order_relaxed);
+            return f;
+        }
+
+        void Release(void *p) {
+            auto f = static_cast<Free *>(p);
+            f->next = list;
+            list = f;
+            count++;
+            if (pool.live.fetch_sub(1, std::memory_order_relaxed) == 1)
+                pool.Give(list, count, count);
+            else if (count >= CACHE_BLOCKS)
+                pool.Give(list, count, CACHE_BLOCKS / 2);
+        }
+    };
+};
+
+// Derive T from this to allocate it from a BlockPool of its own.
+template<typename T> struct Pooled {
+    static BlockPool &Pool() {
+        static BlockPool pool(sizeof(T));
+        return pool;
+    }
+    static BlockPool::Cache &Cache() {
+        static thread_local BlockPool::Cache cache(Pool());
+        return cache;
+    }
+    static void *operator new(size_t size) {
+        ASSERT(size == sizeof(T));
+        return Cache().Alloc();
+    }
+    static void *operator new(size_t size, const char *, int) { return operator new(size); }
+    static void operator delete(void *p) { Cache().Release(p); }
+    static void operator delete(void *p, const char *, int) { Cache().Release(p); }
+};
+
 // for use with vc++ crtdbg
 
 #if defined(_DEBUG) && defined(_WIN32)
@@ -127,7 +246,7 @@ inline uint32_t FNV1A32(std::vector<uint8_t> &vec) {
     return hash;
 }
 
-inline uint64_t FNV1A64(uint8_t *data, size_t size) {
+inline uint64_t FNV1A64(const uint8_t *data, size_t size) {
     uint64_t hash = 0xCBF29CE484222325;
     for (size_t i = 0; i < size; ++i) {
         hash ^= data[i];
@@ -135,3 +254,29 @@ inline uint64_t FNV1A64(uint8_t *data, size_t size) {
     }
     return hash;
 }
+
+// Hashes 8 bytes at a time in 4 independent lanes, for in-memory lookups only: unlike FNV1A64
+// its values may change between versions, so never save or export them.
+inline uint64_t WideHash64(const uint8_t *data, size_t size) {
+    const uint64_t k = 0x9E3779B97F4A7C15;
+    auto mix = [k](uint64_t h, uint64_t w) {
+        h ^= w;
+        return ((h << 31) | (h >> 33)) * k;
+    };
+    auto word = [data](size_t i) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        return w;
+    };
+    uint64_t lanes[4] = {size, k, k << 1, k << 2};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+        for (size_t l = 0; l < 4; l++) lanes[l] = mix(lanes[l], word(i + l * 8));
+    for (; i + 8 <= size; i += 8) lanes[0] = mix(lanes[0], word(i));
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    lanes[1] = mix(lanes[1], tail);
+    uint64_t hash = 0;
+    for (auto lane : lanes) hash = mix(hash, lane) ^ (hash >> 29);
+    return hash;
+}
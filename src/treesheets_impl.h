@@ -91,7 +91,7 @@ struct TreeSheetsScriptImpl : public ScriptInterface {
 
     void GoToChild(int n) {
         if (current->grid && n < current->grid->xs * current->grid->ys)
-            current = current->grid->cells[n];
+            current = current->grid->C(n % current->grid->xs, n / current->grid->xs);
     }
 
     void GoToColumnRow(int x, int y) {
@@ -99,12 +99,12 @@ struct TreeSheetsScriptImpl : public ScriptInterface {
             current = current->grid->C(x, y);
     }
 
-    std::string GetText() { return current->text.t.utf8_string(); }
+    std::string GetText() { return current->text.GetText().utf8_string(); }
 
     void SetText(std::string_view t) {
         if (current->parent) {
             AddUndoIfNecessary();
-            current->text.t = wxString::FromUTF8(t.data(), t.size());
+            current->text.SetText(wxString::FromUTF8(t.data(), t.size()));
         }
     }
 
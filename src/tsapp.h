@@ -11,6 +11,7 @@ struct TSApp : wxApp {
     unique_ptr<IPCServer> serv {make_unique<IPCServer>()};
     wxString filename;
     bool initiateventloop {false};
+    bool headless {false};
     wxString exename;
     wxString exepath;
     unique_ptr<wxSingleInstanceChecker> instance_checker {nullptr};
@@ -108,6 +109,7 @@ struct TSApp : wxApp {
     #endif
 
     int OnExit() override {
+        if (sys) sys->WaitForSave();
         DELETEP(sys);
         return 0;
     }
@@ -34,7 +34,9 @@ struct TSCanvas : public wxScrolledCanvas {
             wxPaintDC dc(this);
         #endif
         DoPrepareDC(dc);
+        sys->drawgeneration++;
         doc->Draw(dc);
+        sys->TrimImageCache();
     };
 
     void OnScrollToSelectionRequest(wxCommandEvent &event) {
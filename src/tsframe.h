@@ -88,6 +88,7 @@ struct TSFrame : wxFrame {
         else
             taskbaricon.Connect(wxID_ANY, wxEVT_TASKBAR_LEFT_DCLICK,
                         wxTaskBarIconEventHandler(TSFrame::OnTBIDBLClick), nullptr, this);
+        Connect(wxEVT_IDLE, wxIdleEventHandler(TSFrame::OnIdle));
 
         bool showtbar, showsbar, lefttabs;
 
@@ -566,6 +567,14 @@ struct TSFrame : wxFrame {
         MyAppend(optmenu, A_SETLANG, _(L"Change language..."), _(L"Change interface language"));
         MyAppend(optmenu, A_DEFAULTMAXCOLWIDTH, _(L"Default column width..."),
                  _(L"Set the default column width for a new grid"));
+        MyAppend(optmenu, A_IMAGECACHE, _(L"Image memory..."),
+                 _(L"Set how much memory images that are not on screen may keep decoded"));
+        MyAppend(optmenu, A_UNDOMEMORY, _(L"Undo memory..."),
+                 _(L"Set how much memory the undo history of a document may use"));
+        MyAppend(optmenu, A_UNDODISK, _(L"Undo disk space..."),
+                 _(L"Set how much of the undo history may be moved to a temporary file"));
+        MyAppend(optmenu, A_UNDOSTEPS, _(L"Undo steps..."),
+                 _(L"Set how many steps the undo history keeps at most"));
         optmenu->AppendSeparator();
         MyAppend(optmenu, A_CUSTCOL, _(L"Custom &color..."),
                  _(L"Set a custom color for the color dropdowns"));
@@ -611,6 +620,10 @@ struct TSFrame : wxFrame {
         optmenu->AppendCheckItem(A_AUTOSAVE, _(L"Autosave"),
                                  _(L"Save open documents periodically to temporary files"));
         optmenu->Check(A_AUTOSAVE, sys->autosave);
+        optmenu->AppendCheckItem(A_JOURNAL, _(L"Save changes to a journal"),
+                                 _(L"Save only what changed, to a journal file next to the "
+                                   L"document that is folded back into it from time to time"));
+        optmenu->Check(A_JOURNAL, sys->journal);
         optmenu->AppendCheckItem(
             A_FSWATCH, _(L"Autoreload documents"),
             _(L"Reload when another computer has changed a file (if you have made changes, asks)"));
@@ -708,7 +721,7 @@ struct TSFrame : wxFrame {
 
         ConstructToolBar();
 
-        auto sb = CreateStatusBar(5);
+        auto sb = CreateStatusBar(6);
         SetStatusBarPane(0);
         SetDPIAwareStatusWidths();
         sb->Show(sys->showstatusbar);
@@ -754,6 +767,8 @@ struct TSFrame : wxFrame {
         aui.AddPane(notebook, wxCENTER);
         aui.Update();
 
+        if (app->headless) return;
+
         Show(!IsIconized());
 
         // needs to be after Show() to avoid scrollbars rendered in the wrong place?
@@ -992,9 +1007,46 @@ struct TSFrame : wxFrame {
                 break;
             }
 
+            case A_IMAGECACHE: {
+                int mb = wxGetNumberFromUser(_(L"Please enter the memory for decoded images:"),
+                                             _(L"Megabytes"), _(L"Image memory"),
+                                             sys->imagecachemb, 16, 65536, sys->frame);
+                if (mb > 0) {
+                    sys->cfg->Write(L"imagecachemb", sys->imagecachemb = mb);
+                    sys->TrimImageCache();
+                }
+                break;
+            }
+
+            case A_UNDOMEMORY: {
+                int mb = wxGetNumberFromUser(
+                    _(L"Please enter the memory for the undo history of each document:"),
+                    _(L"Megabytes"), _(L"Undo memory"), sys->undomemorymb, 1, 65536, sys->frame);
+                if (mb > 0) sys->cfg->Write(L"undomemorymb", sys->undomemorymb = mb);
+                break;
+            }
+
+            case A_UNDODISK: {
+                int mb = wxGetNumberFromUser(
+                    _(L"Please enter the disk space for older undo history, or 0 for none:"),
+                    _(L"Megabytes"), _(L"Undo disk space"), sys->undodiskmb, 0, 1048576,
+                    sys->frame);
+                if (mb >= 0) sys->cfg->Write(L"undodiskmb", sys->undodiskmb = mb);
+                break;
+            }
+
+            case A_UNDOSTEPS: {
+                int n = wxGetNumberFromUser(_(L"Please enter the number of undo steps to keep:"),
+                                            _(L"Steps"), _(L"Undo steps"), sys->undosteps, 1,
+                                            1000000, sys->frame);
+                if (n > 0) sys->cfg->Write(L"undosteps", sys->undosteps = n);
+                break;
+            }
+
             case A_LEFTTABS: Check(L"lefttabs"); break;
             case A_SINGLETRAY: Check(L"singletray"); break;
             case A_MAKEBAKS: sys->cfg->Write(L"makebaks", sys->makebaks = ce.IsChecked()); break;
+            case A_JOURNAL: sys->cfg->Write(L"journal", sys->journal = ce.IsChecked()); break;
             case A_TOTRAY: sys->cfg->Write(L"totray", sys->totray = ce.IsChecked()); break;
             case A_MINCLOSE: sys->cfg->Write(L"minclose", sys->minclose = ce.IsChecked()); break;
             case A_ZOOMSCR: sys->cfg->Write(L"zoomscroll", sys->zoomscroll = ce.IsChecked()); break;
@@ -1103,7 +1155,7 @@ struct TSFrame : wxFrame {
     void OnSearch(wxCommandEvent &ce) {
         auto searchstring = ce.GetString();
         sys->darkennonmatchingcells = searchstring.Len() != 0;
-        sys->searchstring = sys->casesensitivesearch ? searchstring : searchstring.Lower();
+        sys->SetSearchString(sys->casesensitivesearch ? searchstring : searchstring.Lower());
         TSCanvas *canvas = GetCurrentTab();
         Document *doc = canvas->doc;
         if (doc->searchfilter) {
@@ -1187,6 +1239,8 @@ struct TSFrame : wxFrame {
                 }
             }
             // all files have been saved/discarded
+            sys->WaitForSave();
+            wxTheApp->ProcessPendingEvents();  // let SaveDone finish while the tabs are open
             while (notebook->GetPageCount()) {
                 GetCurrentTab()->doc->RemoveTmpFile();
                 notebook->DeletePage(notebook->GetSelection());
@@ -1214,6 +1268,19 @@ struct TSFrame : wxFrame {
         Destroy();
     }
 
+    void OnIdle(wxIdleEvent &event) {
+        event.Skip();
+        if (!notebook) return;
+        loop(i, notebook->GetPageCount()) {
+            auto doc = static_cast<TSCanvas *>(notebook->GetPage(i))->doc;
+            if (!doc->undotrimpending) continue;
+            // one undo item per idle event, so the next key press never waits for more
+            doc->TrimUndo(1);
+            if (doc->undotrimpending) event.RequestMore();
+            return;
+        }
+    }
+
     void OnFileSystemEvent(wxFileSystemWatcherEvent &event) {
         // 0xF == create/delete/rename/modify
         if ((event.GetChangeType() & 0xF) == 0 || watcherwaitingforuser || !notebook) return;
@@ -1221,6 +1288,7 @@ struct TSFrame : wxFrame {
         loop(i, notebook->GetPageCount()) {
             Document *doc = static_cast<TSCanvas *>(notebook->GetPage(i))->doc;
             if (modfile == doc->filename) {
+                if (doc->saving) return;  // our own write, SaveDone updates lastmodificationtime
                 auto modtime = wxFileName(modfile).GetModificationTime();
                 // Compare with last modified to trigger multiple times.
                 if (!modtime.IsValid() || !doc->lastmodificationtime.IsValid() ||
@@ -1267,18 +1335,9 @@ struct TSFrame : wxFrame {
         // block all other events until we finished preparing
         wxEventBlocker blocker(this);
         wxBusyCursor wait;
-        {
-            ThreadPool pool(std::thread::hardware_concurrency());
-            for (const auto &image : sys->imagelist) {
-                pool.enqueue(
-                    [](auto img) {
-                        img->bm_display = wxNullBitmap;
-                        img->Display();
-                    },
-                    image.get());
-            }
-        }  // wait until all tasks are finished
+        for (auto &image : sys->imagelist) image->DropBitmap();
         RenderFolderIcon();
+        sys->fontgeneration++;
         dce.Skip();
     }
 
@@ -1322,6 +1381,13 @@ struct TSFrame : wxFrame {
         return nullptr;
     }
 
+    int PageOf(Document *doc) {
+        if (notebook) loop(i, notebook->GetPageCount()) {
+                if (static_cast<TSCanvas *>(notebook->GetPage(i))->doc == doc) return i;
+            }
+        return -1;
+    }
+
     void MyAppend(wxMenu *menu, int tag, const wxString &contents, const wchar_t *help = L"") {
         auto item = contents;
         wxString key = L"";
@@ -1362,8 +1428,9 @@ struct TSFrame : wxFrame {
     }
 
     void SetDPIAwareStatusWidths() {
-        int statusbarfieldwidths[] = {-1, FromDIP(300), FromDIP(120), FromDIP(100), FromDIP(150)};
-        SetStatusWidths(5, statusbarfieldwidths);
+        int statusbarfieldwidths[] = {-1,           FromDIP(300), FromDIP(120),
+                                      FromDIP(100), FromDIP(200), FromDIP(250)};
+        SetStatusWidths(6, statusbarfieldwidths);
     }
 
     void SetFileAssoc(wxString &exename) {
@@ -1401,6 +1468,7 @@ struct TSFrame : wxFrame {
     }
 
     void TabsReset() {
+        sys->fontgeneration++;
         if (notebook) loop(i, notebook->GetPageCount()) {
                 auto canvas = static_cast<TSCanvas *>(notebook->GetPage(i));
                 canvas->doc->root->ResetChildren();
@@ -1418,7 +1486,15 @@ struct TSFrame : wxFrame {
                     1);
             } else
                 for (int field : {1, 2, 3}) SetStatusText("", field);
-            SetStatusText(wxString::Format(_(L"%d cell(s)"), s.xs * s.ys), 4);
+            auto sel = s.grid->Stats(s);
+            SetStatusText(wxString::Format(_(L"%d cell(s), %zu word(s)"), s.xs * s.ys, sel.words),
+                          4);
+            auto all = s.grid->cell;
+            while (all->parent) all = all->parent;
+            auto doc = all->Stats();
+            SetStatusText(wxString::Format(_(L"Document: %zu cells, %zu words, %zu chars"),
+                                           doc.cells, doc.words, doc.chars),
+                          5);
         }
     }
 
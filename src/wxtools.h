@@ -233,9 +233,45 @@ static wxBitmap ConvertBufferToWxBitmap(const vector<uint8_t> &buffer, wxBitmapT
     return bitmap;
 }
 
-static uint64_t CalculateHash(vector<uint8_t> &buffer) {
-    int max = 4096;
-    return FNV1A64(buffer.data(), min(buffer.size(), max));
+// The pixel size from the PNG or JPEG header, without decoding. Empty if it can't be found.
+static wxSize ReadImageSize(const vector<uint8_t> &buffer, wxBitmapType bitmaptype) {
+    auto b = buffer.data();
+    auto n = buffer.size();
+    auto be16 = [&](size_t i) { return b[i] << 8 | b[i + 1]; };
+    auto be32 = [&](size_t i) { return uint32_t(be16(i)) << 16 | be16(i + 2); };
+    if (bitmaptype == wxBITMAP_TYPE_PNG) {
+        // signature, then IHDR always comes first
+        if (n < 24 || memcmp(b + 12, "IHDR", 4)) return wxSize();
+        auto w = be32(16), h = be32(20);
+        if (w > INT_MAX || h > INT_MAX) return wxSize();
+        return wxSize(int(w), int(h));
+    }
+    if (bitmaptype != wxBITMAP_TYPE_JPEG || n < 4 || be16(0) != 0xFFD8) return wxSize();
+    for (size_t i = 2; i + 4 <= n;) {
+        if (b[i] != 0xFF) return wxSize();
+        auto marker = b[i + 1];
+        if (marker == 0xFF) {  // fill byte
+            i++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {  // no length
+            i += 2;
+            continue;
+        }
+        // start of frame, except DHT, JPG and DAC which share its range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 &&
+            marker != 0xCC) {
+            if (i + 9 > n) return wxSize();
+            return wxSize(be16(i + 7), be16(i + 5));
+        }
+        if (marker == 0xDA || marker == 0xD9) return wxSize();  // image data without a frame
+        i += 2 + be16(i + 2);
+    }
+    return wxSize();
+}
+
+static uint64_t CalculateHash(const vector<uint8_t> &buffer) {
+    return FNV1A64(buffer.data(), min(buffer.size(), size_t(4096)));
 }
 
 static void GetFilesFromUser(wxArrayString &filenames, wxWindow *parent, const wxChar *title,